@@ -0,0 +1,219 @@
+#pragma once
+#include "utils.h"
+#include <atomic>
+#include <functional>
+#include <linux/futex.h>
+#include <mutex>
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <thread>
+#include <time.h>
+#include <unistd.h>
+#include <vector>
+
+enum idle_strategy : uint8_t
+{
+    // keep polling, lowest drain latency, burns the whole core
+    IDLE_BUSY_SPIN = 0,
+    // pause a few times, then sched_yield
+    IDLE_YIELD = 1,
+    // futex wait, an idle backend picks up new logs after at most sleep_ns
+    IDLE_SLEEP = 2,
+};
+
+struct backend_options
+{
+    // pin the backend thread to this core, -1 keeps the inherited affinity
+    int           cpu_id{-1};
+    idle_strategy idle{IDLE_YIELD};
+    int64_t       sleep_ns{100000};
+    // number of consecutive empty polls before the idle strategy kicks in
+    uint32_t      spin_before_idle{64};
+    const char   *name{"fast_logger"};
+};
+
+// Background thread running the poll loop on behalf of the application. A
+// task is any callable returning the number of messages it handled, so one
+// backend can service fast_logger and any number of stra_logger instances.
+class backend_thread
+{
+  public:
+    using poll_fn = std::function<size_t()>;
+
+    backend_thread()
+    {
+    }
+    ~backend_thread()
+    {
+        stop();
+    }
+    backend_thread(const backend_thread &)            = delete;
+    backend_thread &operator=(const backend_thread &) = delete;
+
+    bool start(const backend_options &opts = backend_options())
+    {
+        if (thread_.joinable())
+            return false;
+        opts_ = opts;
+        applied_version_.store(0, std::memory_order_relaxed);
+        running_.store(true, std::memory_order_release);
+        thread_ = std::thread(&backend_thread::run, this);
+        return true;
+    }
+
+    // stops the loop after a final drain of every task
+    void stop()
+    {
+        if (!thread_.joinable())
+            return;
+        running_.store(false, std::memory_order_release);
+        wake();
+        thread_.join();
+    }
+
+    bool running() const
+    {
+        return running_.load(std::memory_order_acquire);
+    }
+
+    uint32_t add_task(poll_fn fn)
+    {
+        std::lock_guard<std::mutex> lock(task_mutex_);
+        uint32_t                    id = ++last_task_id_;
+        tasks_.push_back(task{id, std::move(fn)});
+        tasks_version_.fetch_add(1, std::memory_order_release);
+        return id;
+    }
+
+    template <typename Logger>
+    uint32_t add_logger(Logger *logger)
+    {
+        return add_task([logger] { return logger->poll(); });
+    }
+
+    // after remove_task returns the backend no longer touches the task, so
+    // e.g. a stra_logger can be deleted safely
+    void remove_task(uint32_t id)
+    {
+        uint32_t version;
+        {
+            std::lock_guard<std::mutex> lock(task_mutex_);
+            for (size_t i = 0; i < tasks_.size(); i++) {
+                if (tasks_[i].id == id) {
+                    tasks_.erase(tasks_.begin() + i);
+                    break;
+                }
+            }
+            version = tasks_version_.fetch_add(1, std::memory_order_release) + 1;
+        }
+        if (!thread_.joinable() || std::this_thread::get_id() == thread_.get_id())
+            return;
+        wake();
+        while (applied_version_.load(std::memory_order_acquire) < version) {
+            std::this_thread::yield();
+        }
+    }
+
+  private:
+    struct task
+    {
+        uint32_t id;
+        poll_fn  fn;
+    };
+
+    void run()
+    {
+        if (opts_.cpu_id >= 0) {
+            cpu_set_t cpuset;
+            CPU_ZERO(&cpuset);
+            CPU_SET(opts_.cpu_id, &cpuset);
+            int err = pthread_setaffinity_np(pthread_self(), sizeof(cpuset), &cpuset);
+            if (err) {
+                fprintf(stderr, "backend_thread: failed to pin to cpu %d, err %d\n", opts_.cpu_id, err);
+            }
+        }
+        if (opts_.name) {
+            char name[16] = {0};
+            strncpy(name, opts_.name, sizeof(name) - 1);
+            pthread_setname_np(pthread_self(), name);
+        }
+        std::vector<task> tasks;
+        uint32_t          empty_polls = 0;
+        while (running_.load(std::memory_order_acquire)) {
+            refresh_tasks(tasks);
+            size_t cnt = 0;
+            for (auto &t : tasks) {
+                cnt += t.fn();
+            }
+            if (cnt) {
+                empty_polls = 0;
+            } else {
+                idle(empty_polls);
+            }
+        }
+        // final drain, a poll only handles logs older than its start
+        while (true) {
+            refresh_tasks(tasks);
+            size_t cnt = 0;
+            for (auto &t : tasks) {
+                cnt += t.fn();
+            }
+            if (!cnt)
+                break;
+        }
+        applied_version_.store(UINT32_MAX, std::memory_order_release);
+    }
+
+    void refresh_tasks(std::vector<task> &tasks)
+    {
+        uint32_t version = tasks_version_.load(std::memory_order_acquire);
+        if (version == applied_version_.load(std::memory_order_relaxed))
+            return;
+        {
+            std::lock_guard<std::mutex> lock(task_mutex_);
+            tasks   = tasks_;
+            version = tasks_version_.load(std::memory_order_relaxed);
+        }
+        applied_version_.store(version, std::memory_order_release);
+    }
+
+    void idle(uint32_t &empty_polls)
+    {
+        if (opts_.idle == IDLE_BUSY_SPIN || ++empty_polls < opts_.spin_before_idle) {
+            details::cpu_relax();
+            return;
+        }
+        if (opts_.idle == IDLE_YIELD) {
+            std::this_thread::yield();
+            return;
+        }
+        timespec ts;
+        ts.tv_sec  = opts_.sleep_ns / 1000000000;
+        ts.tv_nsec = opts_.sleep_ns % 1000000000;
+        uint32_t seq = wake_seq_.load(std::memory_order_acquire);
+        if (!running_.load(std::memory_order_acquire) || tasks_version_.load(std::memory_order_acquire) != applied_version_.load(std::memory_order_relaxed))
+            return;
+        syscall(SYS_futex, reinterpret_cast<uint32_t *>(&wake_seq_), FUTEX_WAIT_PRIVATE, seq, &ts, nullptr, 0);
+    }
+
+    void wake()
+    {
+        wake_seq_.fetch_add(1, std::memory_order_release);
+        syscall(SYS_futex, reinterpret_cast<uint32_t *>(&wake_seq_), FUTEX_WAKE_PRIVATE, 1, nullptr, nullptr, 0);
+    }
+
+  private:
+    backend_options       opts_;
+    std::thread           thread_;
+    std::atomic<bool>     running_{false};
+    std::atomic<uint32_t> wake_seq_{0};
+    std::mutex            task_mutex_;
+    std::vector<task>     tasks_;
+    uint32_t              last_task_id_{0};
+    std::atomic<uint32_t> tasks_version_{0};
+    std::atomic<uint32_t> applied_version_{0};
+};
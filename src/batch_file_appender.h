@@ -0,0 +1,486 @@
+#pragma once
+#include "log_sink.h"
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <linux/io_uring.h>
+#include <mutex>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+enum batch_io_mode : uint8_t
+{
+    // a writer thread hands every batch of full buffers to one pwritev
+    BATCH_IO_WRITEV = 0,
+    // full buffers are queued as io_uring writes and reaped when recycled,
+    // falls back to BATCH_IO_WRITEV when io_uring is not available
+    BATCH_IO_URING = 1,
+};
+
+struct batch_file_options
+{
+    batch_io_mode mode{BATCH_IO_WRITEV};
+    // open with O_DIRECT to bypass the page cache
+    bool          direct{false};
+    // rounded up to a multiple of 4 KiB
+    uint32_t      buffer_bytes{1024 * 1024};
+    uint32_t      buffer_cnt{8};
+};
+
+// Sink formatting into large aligned buffers, a full buffer is handed to the
+// kernel and recycled once written. The poller only waits when every buffer
+// is in flight, i.e. when the disk can not keep up for a while.
+class batch_file_appender : public log_sink
+{
+  public:
+    static constexpr size_t IO_BLOCK_BYTES = 4096;
+
+    explicit batch_file_appender(const char *filename, const batch_file_options &opts = batch_file_options()) : opts_(opts)
+    {
+        opts_.buffer_bytes = static_cast<uint32_t>((std::max<uint32_t>(opts_.buffer_bytes, IO_BLOCK_BYTES) + IO_BLOCK_BYTES - 1) & ~(IO_BLOCK_BYTES - 1));
+        opts_.buffer_cnt   = std::max<uint32_t>(opts_.buffer_cnt, 2);
+        int flags          = O_RDWR | O_CREAT | O_CLOEXEC;
+        if (opts_.direct)
+            flags |= O_DIRECT;
+        fd_ = ::open(filename, flags, 0644);
+        if (fd_ < 0 && opts_.direct) {
+            fprintf(stderr, "batch_file_appender: O_DIRECT open of %s failed %d, using the page cache\n", filename, errno);
+            opts_.direct = false;
+            fd_          = ::open(filename, flags & ~O_DIRECT, 0644);
+        }
+        if (fd_ < 0) {
+            fprintf(stderr, "batch_file_appender: open %s failed %d\n", filename, errno);
+        }
+        for (uint32_t i = 0; i < opts_.buffer_cnt; i++) {
+            buffers_.push_back(static_cast<char *>(aligned_alloc(IO_BLOCK_BYTES, opts_.buffer_bytes)));
+        }
+        free_.assign(buffers_.begin() + 1, buffers_.end());
+        cur_ = buffers_[0];
+
+        struct stat st;
+        off_t       size = fd_ >= 0 && ::fstat(fd_, &st) == 0 ? st.st_size : 0;
+        next_off_        = size;
+        if (opts_.direct) {
+            // O_DIRECT writes whole blocks, start with the partial last one
+            next_off_ = size & ~static_cast<off_t>(IO_BLOCK_BYTES - 1);
+            if (size != next_off_) {
+                ssize_t n = ::pread(fd_, cur_, IO_BLOCK_BYTES, next_off_);
+                cur_len_  = n > 0 ? static_cast<size_t>(n) : 0;
+            }
+        }
+
+        if (opts_.mode == BATCH_IO_URING && !uring_setup()) {
+            fprintf(stderr, "batch_file_appender: io_uring not available, using pwritev\n");
+            opts_.mode = BATCH_IO_WRITEV;
+        }
+        if (opts_.mode == BATCH_IO_WRITEV) {
+            writer_ = std::thread(&batch_file_appender::writer_loop, this);
+        }
+    }
+
+    ~batch_file_appender()
+    {
+        flush();
+        if (writer_.joinable()) {
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                stop_ = true;
+            }
+            cv_.notify_all();
+            writer_.join();
+        }
+        uring_close();
+        if (fd_ >= 0)
+            ::close(fd_);
+        for (auto buf : buffers_) {
+            free(buf);
+        }
+    }
+
+    batch_file_appender(const batch_file_appender &)            = delete;
+    batch_file_appender &operator=(const batch_file_appender &) = delete;
+
+    void append(const char *data, const size_t len) override
+    {
+        if (crash_) {
+            write_all(data, len, next_off_);
+            next_off_ += len;
+            written_bytes_ += len;
+            return;
+        }
+        size_t remain = len;
+        while (remain > 0) {
+            size_t n = std::min<size_t>(remain, opts_.buffer_bytes - cur_len_);
+            memcpy(cur_ + cur_len_, data, n);
+            cur_len_ += n;
+            data += n;
+            remain -= n;
+            if (cur_len_ == opts_.buffer_bytes) {
+                submit(cur_, cur_len_);
+                cur_     = get_free();
+                cur_len_ = 0;
+            }
+        }
+        written_bytes_ += len;
+    }
+
+    // hands the partial buffer to the kernel and waits for every write
+    void flush() override
+    {
+        if (fd_ < 0 || crash_)
+            return;
+        if (!opts_.direct) {
+            if (cur_len_) {
+                submit(cur_, cur_len_);
+                cur_     = get_free();
+                cur_len_ = 0;
+            }
+            wait_idle();
+            return;
+        }
+        wait_idle();
+        if (!cur_len_)
+            return;
+        // write the tail padded to whole blocks, cut the file back to the real
+        // size and keep the partial block, the next write starts over with it
+        size_t padded = (cur_len_ + IO_BLOCK_BYTES - 1) & ~(IO_BLOCK_BYTES - 1);
+        memset(cur_ + cur_len_, 0, padded - cur_len_);
+        write_all(cur_, padded, next_off_);
+        if (::ftruncate(fd_, next_off_ + cur_len_) != 0) {
+            fprintf(stderr, "batch_file_appender::flush() ftruncate failed %d\n", errno);
+        }
+        size_t full = cur_len_ & ~(IO_BLOCK_BYTES - 1);
+        memmove(cur_, cur_ + full, cur_len_ - full);
+        cur_len_ -= full;
+        next_off_ += full;
+    }
+
+    // writes the partial buffer with pwrite and bypasses the buffers from now
+    // on. Buffers already handed to the writer thread or io_uring are written
+    // at their own offsets as long as the process lives.
+    void enter_crash_mode() override
+    {
+        if (fd_ < 0 || crash_)
+            return;
+        crash_ = true;
+        if (opts_.direct) {
+            ::fcntl(fd_, F_SETFL, ::fcntl(fd_, F_GETFL) & ~O_DIRECT);
+        }
+        write_all(cur_, cur_len_, next_off_);
+        next_off_ += cur_len_;
+        cur_len_ = 0;
+    }
+
+    off_t writtenBytes() const
+    {
+        return written_bytes_;
+    }
+
+    // number of times append had to wait for a buffer to be written
+    uint64_t stalls() const
+    {
+        return stalls_;
+    }
+
+  private:
+    struct pending_write
+    {
+        char  *data;
+        size_t len;
+        off_t  off;
+    };
+
+    void submit(char *data, size_t len)
+    {
+        pending_write w{data, len, next_off_};
+        next_off_ += len;
+        if (fd_ < 0) {
+            free_.push_back(data);
+            return;
+        }
+        if (opts_.mode == BATCH_IO_URING) {
+            uring_submit(w);
+            return;
+        }
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            pending_.push_back(w);
+        }
+        cv_.notify_all();
+    }
+
+    char *get_free()
+    {
+        if (opts_.mode == BATCH_IO_URING) {
+            uring_reap(false);
+            if (free_.empty()) {
+                stalls_++;
+                while (free_.empty()) {
+                    uring_reap(true);
+                }
+            }
+            char *buf = free_.back();
+            free_.pop_back();
+            return buf;
+        }
+        std::unique_lock<std::mutex> lock(mutex_);
+        if (free_.empty()) {
+            stalls_++;
+            cv_.wait(lock, [this] { return !free_.empty(); });
+        }
+        char *buf = free_.back();
+        free_.pop_back();
+        return buf;
+    }
+
+    void wait_idle()
+    {
+        if (opts_.mode == BATCH_IO_URING) {
+            while (inflight_cnt_) {
+                uring_reap(true);
+            }
+            return;
+        }
+        std::unique_lock<std::mutex> lock(mutex_);
+        cv_.wait(lock, [this] { return pending_.empty() && !writing_; });
+    }
+
+    void write_all(const char *data, size_t len, off_t off)
+    {
+        while (len > 0) {
+            ssize_t n = ::pwrite(fd_, data, len, off);
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n <= 0) {
+                report_error("batch_file_appender: write", errno);
+                return;
+            }
+            data += n;
+            len -= n;
+            off += n;
+        }
+    }
+
+    void writer_loop()
+    {
+        pthread_setname_np(pthread_self(), "fast_logger_io");
+        std::vector<pending_write>   batch;
+        std::vector<iovec>           iov;
+        std::unique_lock<std::mutex> lock(mutex_);
+        while (true) {
+            cv_.wait(lock, [this] { return stop_ || !pending_.empty(); });
+            if (pending_.empty())
+                break;
+            // buffers are submitted in file order, one batch is contiguous
+            size_t cnt = std::min<size_t>(pending_.size(), IOV_MAX);
+            batch.assign(pending_.begin(), pending_.begin() + cnt);
+            pending_.erase(pending_.begin(), pending_.begin() + cnt);
+            writing_ = true;
+            lock.unlock();
+
+            iov.resize(cnt);
+            size_t total = 0;
+            for (size_t i = 0; i < cnt; i++) {
+                iov[i].iov_base = batch[i].data;
+                iov[i].iov_len  = batch[i].len;
+                total += batch[i].len;
+            }
+            ssize_t n = ::pwritev(fd_, iov.data(), static_cast<int>(cnt), batch[0].off);
+            if (n < 0 && errno != EINTR) {
+                fprintf(stderr, "batch_file_appender: pwritev failed %d\n", errno);
+            } else if (static_cast<size_t>(n < 0 ? 0 : n) < total) {
+                // short write, finish buffer by buffer
+                size_t done = n < 0 ? 0 : static_cast<size_t>(n);
+                for (auto &w : batch) {
+                    if (done >= w.len) {
+                        done -= w.len;
+                        continue;
+                    }
+                    write_all(w.data + done, w.len - done, w.off + done);
+                    done = 0;
+                }
+            }
+
+            lock.lock();
+            for (auto &w : batch) {
+                free_.push_back(w.data);
+            }
+            writing_ = false;
+            cv_.notify_all();
+        }
+    }
+
+    static int io_uring_setup(unsigned entries, io_uring_params *p)
+    {
+        return static_cast<int>(syscall(__NR_io_uring_setup, entries, p));
+    }
+
+    static int io_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags)
+    {
+        return static_cast<int>(syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, nullptr, 0));
+    }
+
+    bool uring_setup()
+    {
+        io_uring_params p;
+        memset(&p, 0, sizeof(p));
+        ring_fd_ = io_uring_setup(opts_.buffer_cnt, &p);
+        if (ring_fd_ < 0)
+            return false;
+        sq_ring_bytes_ = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+        cq_ring_bytes_ = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+        if (p.features & IORING_FEAT_SINGLE_MMAP) {
+            sq_ring_bytes_ = cq_ring_bytes_ = std::max(sq_ring_bytes_, cq_ring_bytes_);
+        }
+        sq_ring_ = ::mmap(nullptr, sq_ring_bytes_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd_, IORING_OFF_SQ_RING);
+        if (sq_ring_ == MAP_FAILED) {
+            sq_ring_ = nullptr;
+            uring_close();
+            return false;
+        }
+        if (p.features & IORING_FEAT_SINGLE_MMAP) {
+            cq_ring_ = sq_ring_;
+        } else {
+            cq_ring_ = ::mmap(nullptr, cq_ring_bytes_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd_, IORING_OFF_CQ_RING);
+            if (cq_ring_ == MAP_FAILED) {
+                cq_ring_ = nullptr;
+                uring_close();
+                return false;
+            }
+        }
+        sqe_bytes_ = p.sq_entries * sizeof(io_uring_sqe);
+        sqes_      = static_cast<io_uring_sqe *>(
+            ::mmap(nullptr, sqe_bytes_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd_, IORING_OFF_SQES));
+        if (sqes_ == MAP_FAILED) {
+            sqes_ = nullptr;
+            uring_close();
+            return false;
+        }
+        char *sq  = static_cast<char *>(sq_ring_);
+        char *cq  = static_cast<char *>(cq_ring_);
+        sq_tail_  = reinterpret_cast<unsigned *>(sq + p.sq_off.tail);
+        sq_mask_  = *reinterpret_cast<unsigned *>(sq + p.sq_off.ring_mask);
+        sq_array_ = reinterpret_cast<unsigned *>(sq + p.sq_off.array);
+        cq_head_  = reinterpret_cast<unsigned *>(cq + p.cq_off.head);
+        cq_tail_  = reinterpret_cast<unsigned *>(cq + p.cq_off.tail);
+        cq_mask_  = *reinterpret_cast<unsigned *>(cq + p.cq_off.ring_mask);
+        cqes_     = reinterpret_cast<io_uring_cqe *>(cq + p.cq_off.cqes);
+        inflight_.resize(opts_.buffer_cnt);
+        return true;
+    }
+
+    void uring_close()
+    {
+        if (sqes_)
+            ::munmap(sqes_, sqe_bytes_);
+        if (cq_ring_ && cq_ring_ != sq_ring_)
+            ::munmap(cq_ring_, cq_ring_bytes_);
+        if (sq_ring_)
+            ::munmap(sq_ring_, sq_ring_bytes_);
+        if (ring_fd_ >= 0)
+            ::close(ring_fd_);
+        sqes_    = nullptr;
+        sq_ring_ = cq_ring_ = nullptr;
+        ring_fd_ = -1;
+    }
+
+    void uring_submit(const pending_write &w)
+    {
+        // one slot per buffer, a free buffer always has a free slot
+        size_t slot = 0;
+        while (inflight_[slot].data)
+            slot++;
+        inflight_[slot] = w;
+        inflight_cnt_++;
+
+        unsigned      tail = *sq_tail_;
+        unsigned      idx  = tail & sq_mask_;
+        io_uring_sqe *sqe  = &sqes_[idx];
+        memset(sqe, 0, sizeof(*sqe));
+        sqe->opcode    = IORING_OP_WRITE;
+        sqe->fd        = fd_;
+        sqe->addr      = reinterpret_cast<uint64_t>(w.data);
+        sqe->len       = static_cast<uint32_t>(w.len);
+        sqe->off       = static_cast<uint64_t>(w.off);
+        sqe->user_data = slot;
+        sq_array_[idx] = idx;
+        __atomic_store_n(sq_tail_, tail + 1, __ATOMIC_RELEASE);
+        while (io_uring_enter(ring_fd_, 1, 0, 0) < 0 && errno == EINTR) {
+        }
+    }
+
+    void uring_reap(bool wait)
+    {
+        if (wait && io_uring_enter(ring_fd_, 0, 1, IORING_ENTER_GETEVENTS) < 0 && errno != EINTR) {
+            fprintf(stderr, "batch_file_appender: io_uring_enter failed %d\n", errno);
+        }
+        unsigned head = *cq_head_;
+        unsigned tail = __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE);
+        for (; head != tail; head++) {
+            io_uring_cqe  *cqe  = &cqes_[head & cq_mask_];
+            pending_write &w    = inflight_[cqe->user_data];
+            size_t         done = cqe->res > 0 ? static_cast<size_t>(cqe->res) : 0;
+            // failed (e.g. IORING_OP_WRITE not supported) or short write,
+            // finish it synchronously
+            if (done < w.len) {
+                write_all(w.data + done, w.len - done, w.off + done);
+            }
+            free_.push_back(w.data);
+            w.data = nullptr;
+            inflight_cnt_--;
+        }
+        __atomic_store_n(cq_head_, head, __ATOMIC_RELEASE);
+    }
+
+  private:
+    batch_file_options  opts_;
+    int                 fd_{-1};
+    std::vector<char *> buffers_;
+    char               *cur_{nullptr};
+    size_t              cur_len_{0};
+    off_t               next_off_{0};
+    off_t               written_bytes_{0};
+    uint64_t            stalls_{0};
+    bool                crash_{false};
+
+    // BATCH_IO_WRITEV, free_ is shared with the writer thread under mutex_
+    std::mutex                 mutex_;
+    std::condition_variable    cv_;
+    std::vector<char *>        free_;
+    std::vector<pending_write> pending_;
+    bool                       writing_{false};
+    bool                       stop_{false};
+    std::thread                writer_;
+
+    // BATCH_IO_URING, only touched by the poller
+    int                        ring_fd_{-1};
+    void                      *sq_ring_{nullptr};
+    void                      *cq_ring_{nullptr};
+    size_t                     sq_ring_bytes_{0};
+    size_t                     cq_ring_bytes_{0};
+    io_uring_sqe              *sqes_{nullptr};
+    size_t                     sqe_bytes_{0};
+    unsigned                  *sq_tail_{nullptr};
+    unsigned                  *sq_array_{nullptr};
+    unsigned                   sq_mask_{0};
+    unsigned                  *cq_head_{nullptr};
+    unsigned                  *cq_tail_{nullptr};
+    unsigned                   cq_mask_{0};
+    io_uring_cqe              *cqes_{nullptr};
+    std::vector<pending_write> inflight_;
+    size_t                     inflight_cnt_{0};
+};
@@ -0,0 +1,74 @@
+#pragma once
+#include <stdint.h>
+
+// On-disk layout of the binary log written by log_handler in binary mode and
+// turned back into text by fast_logger_decompress.
+//
+//   file    := session*
+//   session := file_header entry*
+//   entry   := entry_type payload
+//
+// A new session starts every time a logger (re)opens the file, log ids are
+// only valid inside the session that defined them.
+namespace binary_log {
+
+static constexpr char     MAGIC[8] = {'F', 'L', 'O', 'G', 'B', 'I', 'N', '1'};
+static constexpr uint32_t VERSION  = 4;
+
+enum entry_type : uint8_t
+{
+    // log_info_entry followed by fmt_len bytes of the format string and
+    // args_num bytes of argument sizes, see details::arg_layout
+    ENTRY_LOG_INFO = 1,
+    // tsc_param_entry, every ENTRY_LOG after it is converted with these params
+    ENTRY_TSC_PARAM = 2,
+    // thread_name_entry followed by len bytes, names the thread of the
+    // following ENTRY_LOG records
+    ENTRY_THREAD_NAME = 3,
+    // raw staging buffer record: queue_header (whose 32 bit size covers the
+    // whole record), rdtsc timestamp, arguments laid out by arg_layout. With
+    // staging_buffer::COMPACT_RECORD set in the log id the arguments are
+    // compact, the timestamp is always absolute
+    ENTRY_LOG = 4,
+    // text_entry followed by len bytes, a line written by the logger itself
+    ENTRY_TEXT = 5,
+};
+
+#pragma pack(push, 1)
+struct file_header
+{
+    char     magic[8];
+    uint32_t version;
+    uint32_t reserved;
+};
+
+struct log_info_entry
+{
+    uint32_t log_id;
+    uint32_t line_num;
+    uint8_t  level;
+    uint8_t  args_num;
+    uint32_t fmt_len;
+};
+
+struct tsc_param_entry
+{
+    int64_t base_tsc;
+    int64_t base_ns;
+    double  ns_per_tsc;
+};
+
+struct thread_name_entry
+{
+    uint8_t len;
+};
+
+struct text_entry
+{
+    int64_t  ns;
+    uint8_t  level;
+    uint32_t len;
+};
+#pragma pack(pop)
+
+} // namespace binary_log
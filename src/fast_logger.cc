@@ -1,44 +1,187 @@
 #include "fast_logger.h"
+#include <signal.h>
+#include <stdlib.h>
 
 thread_local staging_buffer                       *fast_logger::staging_buffer_ = nullptr;
 thread_local fast_logger::staging_buffer_destroyer fast_logger::sbc_;
 
-void fast_logger::ensure_staging_buffer_allocated()
+void fast_logger::ensure_staging_buffer_allocated(const staging_buffer_options &opts)
 {
     if (staging_buffer_ == nullptr) {
-        std::unique_lock<std::mutex> guard(buffer_mutex_);
-        guard.unlock();
-        staging_buffer_ = new staging_buffer();
+        staging_buffer_ = take_pooled_buffer(opts);
+        if (staging_buffer_) {
+            staging_buffer_->set_thread_name();
+        } else {
+            staging_buffer_ = new staging_buffer(opts);
+        }
         sbc_.staging_buffer_created();
-        guard.lock();
-        thread_buffers_.push_back(staging_buffer_);
+        // Treiber push, the poller only ever takes the whole stack so there
+        // is no ABA
+        staging_buffer *head = registered_buffers_.load(std::memory_order_relaxed);
+        do {
+            staging_buffer_->set_next_registered(head);
+        } while (!registered_buffers_.compare_exchange_weak(head, staging_buffer_, std::memory_order_release, std::memory_order_relaxed));
     }
 }
 
-staging_buffer::queue_header *fast_logger::alloc(size_t size)
+staging_buffer *fast_logger::take_pooled_buffer(const staging_buffer_options &opts)
 {
-    if (staging_buffer_ == nullptr) {
-        ensure_staging_buffer_allocated();
+    staging_buffer *tb   = nullptr;
+    int             node = staging_buffer::numa_node_for(opts);
+    lock_pool();
+    for (size_t i = buffer_pool_.size(); i-- > 0;) {
+        if (buffer_pool_[i]->same_options(opts, node)) {
+            tb              = buffer_pool_[i];
+            buffer_pool_[i] = buffer_pool_.back();
+            buffer_pool_.pop_back();
+            break;
+        }
+    }
+    unlock_pool();
+    return tb;
+}
+
+// keeps a drained buffer of an exited thread, false when the pool is full
+bool fast_logger::recycle_buffer(staging_buffer *tb)
+{
+    lock_pool();
+    bool keep = buffer_pool_.size() < buffer_pool_max_;
+    if (keep) {
+        tb->reset();
+        buffer_pool_.push_back(tb);
     }
-    return staging_buffer_->alloc(size);
+    unlock_pool();
+    return keep;
 }
 
-void fast_logger::finish()
+// a drained buffer of an exited thread
+void fast_logger::release_buffer(staging_buffer *tb)
 {
-    staging_buffer_->finish();
+    retire_stats(tb);
+    auto it = thread_sinks_.find(tb);
+    if (it != thread_sinks_.end()) {
+        delete it->second;
+        thread_sinks_.erase(it);
+    }
+    if (!recycle_buffer(tb))
+        delete tb;
+}
+
+log_sink *fast_logger::thread_sink(staging_buffer *tb, bool crash)
+{
+    if (thread_file_prefix_.empty())
+        return nullptr;
+    auto it = thread_sinks_.find(tb);
+    if (it != thread_sinks_.end())
+        return it->second;
+    // opening allocates, a crash drain writes to the shared sink instead
+    if (crash)
+        return nullptr;
+    std::string filename = thread_file_prefix_ + "." + tb->get_name() + ".log";
+    log_sink   *sink     = new file_appender(filename.c_str());
+    thread_sinks_.emplace(tb, sink);
+    return sink;
+}
+
+void fast_logger::set_buffer_pool(size_t max_cnt, size_t prefault_cnt)
+{
+    std::vector<staging_buffer *> fresh;
+    for (size_t i = 0; i < std::min(max_cnt, prefault_cnt); i++) {
+        fresh.push_back(new staging_buffer(buffer_opts_));
+    }
+    std::vector<staging_buffer *> extra;
+    lock_pool();
+    buffer_pool_max_ = max_cnt;
+    buffer_pool_.insert(buffer_pool_.end(), fresh.begin(), fresh.end());
+    while (buffer_pool_.size() > buffer_pool_max_) {
+        extra.push_back(buffer_pool_.back());
+        buffer_pool_.pop_back();
+    }
+    unlock_pool();
+    for (auto tb : extra) {
+        delete tb;
+    }
 }
 
 void fast_logger::register_log(static_log_info &info, int &log_id)
 {
+    // info is local to the caller, compile it before taking the lock so that
+    // threads hitting new call sites only serialize on the push_back
+    char *p = static_cast<char *>(malloc(info.fragments_size()));
+    info.create_log_fragments(&p);
     std::lock_guard<std::mutex> lock(register_mutex_);
-    if (log_id != UNASSIGNED_LOGID)
+    if (log_id != UNASSIGNED_LOGID) {
+        free(info.fragments);
         return;
-    char *p = static_cast<char *>(malloc(1024));
-    info.create_log_fragments(&p);
+    }
     log_id = static_cast<int32_t>(log_infos_.size()) + static_cast<int32_t>(log_handler_.get_log_infos_cnt());
     log_infos_.push_back(info);
 }
 
+std::vector<staging_buffer_stats> fast_logger::get_stats()
+{
+    lock_stats();
+    std::vector<staging_buffer_stats> stats(stats_buffers_.size() + 1);
+    for (size_t i = 0; i < stats_buffers_.size(); i++) {
+        stats_buffers_[i]->get_stats(stats[i]);
+    }
+    stats.back() = retired_stats_;
+    unlock_stats();
+    return stats;
+}
+
+void fast_logger::retire_stats(staging_buffer *tb)
+{
+    lock_stats();
+    staging_buffer_stats stats;
+    tb->get_stats(stats);
+    retired_stats_.msgs += stats.msgs;
+    retired_stats_.bytes += stats.bytes;
+    retired_stats_.dropped += stats.dropped;
+    retired_stats_.high_water_bytes = std::max(retired_stats_.high_water_bytes, stats.high_water_bytes);
+    stats_buffers_.erase(std::find(stats_buffers_.begin(), stats_buffers_.end(), tb));
+    unlock_stats();
+}
+
+void fast_logger::write_stats()
+{
+    int64_t ns = tscns_.rdns();
+    for (auto &stats : get_stats()) {
+        char msg[256];
+        int  len = snprintf(msg, sizeof(msg), "staging buffer %s: msgs %lu bytes %lu dropped %lu high water %lu/%u", stats.name, stats.msgs, stats.bytes,
+                            stats.dropped, stats.high_water_bytes, stats.capacity);
+        log_handler_.write_text_log("fast_logger", stats.dropped ? WARN : INFO, ns, msg, len);
+    }
+}
+
+void fast_logger::write_calibration()
+{
+    tscns_stats stats;
+    tscns_.getStats(stats);
+    char msg[128];
+    int  len = snprintf(msg, sizeof(msg), "tsc calibration %lu: err %ldns max %ldns, %.9f ghz", stats.calibrations, stats.last_err_ns, stats.max_abs_err_ns,
+                        stats.tsc_ghz);
+    log_handler_.write_text_log("fast_logger", INFO, tscns_.rdns(), msg, len);
+}
+
+static inline int64_t msg_tsc(const staging_buffer::queue_header *header)
+{
+    return *(const int64_t *)(header + 1);
+}
+
+void fast_logger::push_heap(staging_buffer *tb, const staging_buffer::queue_header *header)
+{
+    bg_thread_buffers_.emplace_back(tb, header);
+    size_t i = bg_thread_buffers_.size() - 1;
+    while (i > 0) {
+        size_t parent = (i - 1) / 2;
+        if (msg_tsc(bg_thread_buffers_[parent].header) <= msg_tsc(header))
+            break;
+        std::swap(bg_thread_buffers_[i], bg_thread_buffers_[parent]);
+        i = parent;
+    }
+}
+
 void fast_logger::adjust_heap(size_t i)
 {
     while (true) {
@@ -46,9 +189,7 @@ void fast_logger::adjust_heap(size_t i)
         size_t ch    = std::min(i * 2 + 1, bg_thread_buffers_.size());
         size_t end   = std::min(ch + 2, bg_thread_buffers_.size());
         for (; ch < end; ch++) {
-            auto h_ch  = bg_thread_buffers_[ch].header;
-            auto h_min = bg_thread_buffers_[min_i].header;
-            if (h_ch && (!h_min || *(int64_t *)(h_ch + 1) < *(int64_t *)(h_min + 1)))
+            if (msg_tsc(bg_thread_buffers_[ch].header) < msg_tsc(bg_thread_buffers_[min_i].header))
                 min_i = ch;
         }
         if (min_i == i)
@@ -58,50 +199,346 @@ void fast_logger::adjust_heap(size_t i)
     }
 }
 
-void fast_logger::poll_inner()
+// a crashed thread may hold any of the mutexes, the crash drain only tries
+static bool lock_for_poll(std::unique_lock<std::mutex> &lock, bool crash)
 {
-    int64_t tsc = tscns_.rdtsc();
-    if (log_infos_.size()) {
-        std::unique_lock<std::mutex> lock(register_mutex_);
-        for (auto info : log_infos_) {
-            log_handler_.add_log_info(info);
+    if (crash)
+        return lock.try_lock();
+    lock.lock();
+    return true;
+}
+
+void fast_logger::take_registered_buffers(bool crash)
+{
+    staging_buffer *head = registered_buffers_.exchange(nullptr, std::memory_order_acquire);
+    // the stack is newest first, keep the registration order
+    staging_buffer *prev = nullptr;
+    while (head) {
+        staging_buffer *next = head->get_next_registered();
+        head->set_next_registered(prev);
+        prev = head;
+        head = next;
+    }
+    if (crash) {
+        // only what fits in the room reserved below, the rest is written out
+        // buffer by buffer
+        for (staging_buffer *tb = prev, *next; tb; tb = next) {
+            next         = tb->get_next_registered();
+            size_t total = idle_buffers_.size() + bg_thread_buffers_.size() + 1;
+            if (total <= idle_buffers_.capacity() && total <= bg_thread_buffers_.capacity()) {
+                idle_buffers_.push_back(tb);
+            } else {
+                drain_buffer_raw(tb, false);
+            }
         }
-        log_infos_.clear();
+        return;
+    }
+    size_t total = idle_buffers_.size() + bg_thread_buffers_.size();
+    for (staging_buffer *tb = prev; tb; tb = tb->get_next_registered()) {
+        total++;
+    }
+    if (idle_buffers_.capacity() < total)
+        idle_buffers_.reserve(total * 2);
+    if (bg_thread_buffers_.capacity() < total)
+        bg_thread_buffers_.reserve(total * 2);
+    lock_stats();
+    if (stats_buffers_.capacity() < total)
+        stats_buffers_.reserve(total * 2);
+    for (staging_buffer *tb = prev; tb; tb = tb->get_next_registered()) {
+        if (pipeline_) {
+            pipeline_->add_buffer(tb);
+        } else {
+            idle_buffers_.push_back(tb);
+        }
+        stats_buffers_.push_back(tb);
+    }
+    unlock_stats();
+}
+
+// moves every buffer to n format workers, or back to the poller with 0
+void fast_logger::set_pipeline(uint32_t n)
+{
+    if (pipeline_) {
+        poll_pipeline(tscns_.rdtsc(), true);
+        std::vector<staging_buffer *> buffers = pipeline_->take_buffers();
+        pipeline_.reset();
+        size_t total = idle_buffers_.size() + bg_thread_buffers_.size() + buffers.size();
+        idle_buffers_.reserve(total * 2);
+        bg_thread_buffers_.reserve(total * 2);
+        idle_buffers_.insert(idle_buffers_.end(), buffers.begin(), buffers.end());
+    }
+    if (n && !log_handler_.is_binary() && thread_file_prefix_.empty()) {
+        pipeline_.reset(new format_pipeline(tscns_, log_handler_, n));
+        for (auto &node : bg_thread_buffers_) {
+            pipeline_->add_buffer(node.tb);
+        }
+        for (auto tb : idle_buffers_) {
+            pipeline_->add_buffer(tb);
+        }
+        bg_thread_buffers_.clear();
+        idle_buffers_.clear();
+    }
+}
+
+size_t fast_logger::poll_pipeline(int64_t tsc, bool wait)
+{
+    size_t cnt = pipeline_->poll(tsc, drain_order_ == DRAIN_ORDERED, wait);
+    for (auto tb : pipeline_->released()) {
+        release_buffer(tb);
     }
-    if (thread_buffers_.size()) {
-        std::unique_lock<std::mutex> lock(buffer_mutex_);
-        for (auto tb : thread_buffers_) {
-            bg_thread_buffers_.emplace_back(tb);
+    pipeline_->released().clear();
+    return cnt;
+}
+
+size_t fast_logger::poll_inner(bool crash)
+{
+    // the crash drain takes everything, not only what was logged before it
+    int64_t tsc = crash ? INT64_MAX : tscns_.rdtsc();
+    if (log_infos_.size()) {
+        std::unique_lock<std::mutex> lock(register_mutex_, std::defer_lock);
+        if (lock_for_poll(lock, crash)) {
+            // the crash drain merges only what fits in the reserved room, the
+            // records of later call sites stay queued. It runs once, so the
+            // queue is left as is.
+            size_t n = crash ? std::min(log_infos_.size(), log_handler_.log_infos_room()) : log_infos_.size();
+            for (size_t i = 0; i < n; i++) {
+                log_handler_.add_log_info(log_infos_[i]);
+            }
+            if (!crash) {
+                log_infos_.clear();
+                log_handler_.reserve_log_infos(LOG_INFO_ROOM);
+            }
         }
-        thread_buffers_.clear();
     }
-    for (size_t i = 0; i < bg_thread_buffers_.size(); i++) {
-        auto &node = bg_thread_buffers_[i];
-        if (node.header)
+    // the format workers only write text to the shared sink
+    if (pipeline_ && !crash && (log_handler_.is_binary() || !thread_file_prefix_.empty())) {
+        set_pipeline(0);
+    }
+    if (registered_buffers_.load(std::memory_order_relaxed)) {
+        take_registered_buffers(crash);
+    }
+    if (!crash && tscns_.calibrate() && log_calibrations_) {
+        if (pipeline_)
+            pipeline_->write_ready(true);
+        write_calibration();
+    }
+    if (!crash && stats_interval_tsc_ && tsc >= next_stats_tsc_) {
+        next_stats_tsc_ = tsc + stats_interval_tsc_;
+        if (pipeline_)
+            pipeline_->write_ready(true);
+        write_stats();
+    }
+    size_t cnt = drain_order_ == DRAIN_UNORDERED ? drain_unordered(tsc, crash) : drain_ordered(tsc, crash);
+    if (pipeline_ && !crash) {
+        cnt += poll_pipeline(tsc, false);
+    }
+    return cnt;
+}
+
+size_t fast_logger::drain_ordered(int64_t tsc, bool crash)
+{
+    for (auto &node : bg_thread_buffers_) {
+        node.tb->update_high_water();
+    }
+    // only buffers that were empty need a look, the heap already has the
+    // front of the others
+    for (size_t i = 0; i < idle_buffers_.size(); i++) {
+        staging_buffer *tb     = idle_buffers_[i];
+        auto            header = tb->front();
+        // the flag is set after the thread's last push, look at the queue
+        // again once it is seen
+        if (!header && !crash && tb->check_can_delete() && !(header = tb->front())) {
+            release_buffer(tb);
+        } else if (header) {
+            tb->update_high_water();
+            push_heap(tb, header);
+        } else {
             continue;
-        node.header = node.tb->front();
-        if (!node.header && node.tb->check_can_delete()) {
-            delete node.tb;
-            node = bg_thread_buffers_.back();
+        }
+        idle_buffers_[i] = idle_buffers_.back();
+        idle_buffers_.pop_back();
+        i--;
+    }
+
+    size_t cnt      = 0;
+    size_t info_cnt = log_handler_.get_log_infos_cnt();
+    while (!bg_thread_buffers_.empty()) {
+        heap_node &top = bg_thread_buffers_[0];
+        auto       h   = top.header;
+        if (staging_buffer::log_id(h) >= info_cnt || msg_tsc(h) >= tsc)
+            break;
+        // drain the top buffer while it stays below the next smallest front
+        int64_t limit = tsc;
+        for (size_t ch = 1; ch < 3 && ch < bg_thread_buffers_.size(); ch++) {
+            limit = std::min(limit, msg_tsc(bg_thread_buffers_[ch].header));
+        }
+        log_sink *sink = thread_sink(top.tb, crash);
+        do {
+            log_handler_.handle_log(top.tb->get_name(), h, sink);
+            top.tb->pop(h);
+            cnt++;
+            h = top.tb->front();
+        } while (h && staging_buffer::log_id(h) < info_cnt && msg_tsc(h) < limit);
+        top.tb->release();
+        if (h) {
+            top.header = h;
+        } else {
+            idle_buffers_.push_back(top.tb);
+            top = bg_thread_buffers_.back();
             bg_thread_buffers_.pop_back();
-            i--;
         }
+        adjust_heap(0);
     }
-    if (bg_thread_buffers_.empty())
-        return;
+    return cnt;
+}
 
-    // build heap
-    for (int i = bg_thread_buffers_.size() / 2; i >= 0; i--) {
-        adjust_heap(i);
+size_t fast_logger::drain_unordered(int64_t tsc, bool crash)
+{
+    // left over from ordered polls
+    for (auto &node : bg_thread_buffers_) {
+        idle_buffers_.push_back(node.tb);
     }
-    while (true) {
-        auto h = bg_thread_buffers_[0].header;
-        if (!h || h->userdata >= log_handler_.get_log_infos_cnt() || *(int64_t *)(h + 1) >= tsc)
-            break;
-        auto tb = bg_thread_buffers_[0].tb;
+    bg_thread_buffers_.clear();
+
+    size_t cnt      = 0;
+    size_t info_cnt = log_handler_.get_log_infos_cnt();
+    for (size_t i = 0; i < idle_buffers_.size(); i++) {
+        staging_buffer *tb = idle_buffers_[i];
+        auto            h  = tb->front();
+        if (!h) {
+            if (!crash && tb->check_can_delete() && !tb->front()) {
+                release_buffer(tb);
+                idle_buffers_[i] = idle_buffers_.back();
+                idle_buffers_.pop_back();
+                i--;
+            }
+            continue;
+        }
+        tb->update_high_water();
+        // stop at what was logged before the poll, so that one busy thread
+        // cannot hold back the others
+        log_sink *sink = thread_sink(tb, crash);
+        while (h && staging_buffer::log_id(h) < info_cnt && msg_tsc(h) < tsc) {
+            log_handler_.handle_log(tb->get_name(), h, sink);
+            tb->pop(h);
+            h = tb->front();
+            cnt++;
+        }
+        tb->release();
+    }
+    return cnt;
+}
+
+// writes the queued records of one buffer to the shared output, no merge
+size_t fast_logger::drain_buffer_raw(staging_buffer *tb, bool front_only)
+{
+    size_t cnt      = 0;
+    size_t info_cnt = log_handler_.get_log_infos_cnt();
+    auto   h        = tb->front();
+    while (h && staging_buffer::log_id(h) < info_cnt) {
         log_handler_.handle_log(tb->get_name(), h);
-        tb->pop();
-        bg_thread_buffers_[0].header = tb->front();
-        adjust_heap(0);
+        cnt++;
+        if (front_only)
+            break;
+        tb->pop(h);
+        h = tb->front();
+    }
+    return cnt;
+}
+
+// the crash drain without the poll lock: the heap and the buffer lists may
+// be half updated, so the buffers come from the stats list and the
+// registration stack. The stats list is skipped when its lock is held, a
+// signal handler can not wait for it.
+//
+// While another thread holds the poll lock only the fronts are written,
+// popping would race with its poll. If that poll goes on, it writes those
+// records again, so each of them can show up twice in the output.
+void fast_logger::drain_raw(bool front_only)
+{
+    if (!stats_lock_.exchange(true, std::memory_order_acquire)) {
+        for (auto tb : stats_buffers_) {
+            drain_buffer_raw(tb, front_only);
+        }
+        unlock_stats();
+    }
+    staging_buffer *tb = registered_buffers_.exchange(nullptr, std::memory_order_acquire);
+    for (; tb; tb = tb->get_next_registered()) {
+        drain_buffer_raw(tb, front_only);
+    }
+}
+
+void fast_logger::crash_drain()
+{
+    if (crashed_.exchange(true))
+        return;
+    // wait a moment for a poll on another thread, unless we crashed inside it
+    bool in_poll = poll_lock_.load(std::memory_order_relaxed) && poll_owner_ == pthread_self();
+    bool locked  = false;
+    for (int i = 0; !in_poll && i < (1 << 22); i++) {
+        if (!poll_lock_.exchange(true, std::memory_order_acquire)) {
+            locked = true;
+            break;
+        }
+        details::cpu_relax();
+    }
+    log_handler_.set_signal_safe();
+    staging_buffer::set_signal_safe();
+    if (!locked) {
+        // format workers pop the rings they own, they have to stop first
+        bool pop = in_poll && (!pipeline_ || pipeline_->park_workers());
+        drain_raw(!pop);
+        log_handler_.flush();
+        return;
+    }
+    for (auto &it : thread_sinks_) {
+        it.second->enter_crash_mode();
+    }
+    if (pipeline_)
+        pipeline_->crash_flush();
+    poll_inner(true);
+    log_handler_.flush();
+    for (auto &it : thread_sinks_) {
+        it.second->flush();
+    }
+}
+
+static struct sigaction old_actions[NSIG];
+static const int        crash_signals[] = {SIGSEGV, SIGABRT, SIGBUS, SIGFPE, SIGILL, SIGTERM};
+
+static void crash_signal_handler(int sig, siginfo_t *, void *)
+{
+    fast_logger::get_logger().crash_drain();
+    // the previous handler or the default action takes it from here
+    sigaction(sig, &old_actions[sig], nullptr);
+    raise(sig);
+}
+
+static void crash_at_exit()
+{
+    fast_logger::get_logger().stop_backend();
+    fast_logger::get_logger().flush();
+}
+
+void fast_logger::install_crash_handler()
+{
+    // construct the logger now, not inside the signal handler
+    get_logger();
+    // lets the handler run on a stack overflow of the installing thread
+    static char alt_stack[64 * 1024];
+    stack_t     ss;
+    ss.ss_sp    = alt_stack;
+    ss.ss_size  = sizeof(alt_stack);
+    ss.ss_flags = 0;
+    sigaltstack(&ss, nullptr);
+
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_sigaction = crash_signal_handler;
+    sa.sa_flags     = SA_SIGINFO | SA_ONSTACK;
+    sigemptyset(&sa.sa_mask);
+    for (int sig : crash_signals) {
+        sigaction(sig, &sa, &old_actions[sig]);
     }
+    std::atexit(crash_at_exit);
 }
@@ -1,5 +1,8 @@
 #pragma once
+#include "backend_thread.h"
+#include "batch_file_appender.h"
 #include "file_appender.h"
+#include "format_pipeline.h"
 #include "level.h"
 #include "log_handler.h"
 #include "staging_buffer.h"
@@ -8,11 +11,26 @@
 #include "utils.h"
 #include <algorithm>
 #include <assert.h>
+#include <atomic>
 #include <iostream>
+#include <memory>
 #include <mutex>
+#include <pthread.h>
 #include <stdint.h>
 #include <string.h>
+#include <string>
+#include <unordered_map>
 #include <vector>
+
+enum drain_order : uint8_t
+{
+    // merge all threads by timestamp
+    DRAIN_ORDERED = 0,
+    // drain the threads one after the other, lines of different threads
+    // interleave by poll rather than by timestamp
+    DRAIN_UNORDERED = 1,
+};
+
 class fast_logger
 {
   public:
@@ -23,6 +41,13 @@ class fast_logger
     }
     ~fast_logger()
     {
+        stop_backend();
+        for (auto tb : buffer_pool_) {
+            delete tb;
+        }
+        for (auto &it : thread_sinks_) {
+            delete it.second;
+        }
     }
     template <int M, typename... Ts>
     inline void log(int &log_id, const int linenum, const log_level level, const char (&format)[M], int n_params, Ts... args)
@@ -32,21 +57,32 @@ class fast_logger
             return;
         }
         if (log_id == UNASSIGNED_LOGID) {
-            static_log_info info(linenum, level, format, static_cast<uint8_t>(sizeof...(args)));
+            static_log_info info(linenum, level, format, static_cast<uint8_t>(sizeof...(args)), details::arg_layout<Ts...>::sizes);
             register_log(info, log_id);
         }
-        uint64_t timestamp                       = tscns_.rdtsc();
-        size_t   string_sizes[sizeof...(Ts) + 1] = {}; // HACK: Zero length arrays are not allowed
-        size_t   alloc_size                      = details::get_arg_sizes(string_sizes, args...) + sizeof(timestamp);
-        auto     header                          = alloc(alloc_size);
-        if (!header)
+        write_log(log_id, args...);
+        if (level == FATAL)
+            flush();
+    }
+
+    // for call sites registered before main, see FAST_LOG_STATIC
+    template <typename... Ts>
+    inline void log_registered(const int log_id, const log_level level, int n_params, Ts... args)
+    {
+        assert(n_params == static_cast<uint32_t>(sizeof...(Ts)));
+        if (static_cast<int>(level) < static_cast<int>(cur_level_)) {
             return;
-        header->userdata       = log_id;
-        char *write_pos        = (char *)(header + 1);
-        *(uint64_t *)write_pos = timestamp;
-        write_pos += sizeof(timestamp);
-        details::store_arguments(string_sizes, &write_pos, args...);
-        finish();
+        }
+        write_log(log_id, args...);
+        if (level == FATAL)
+            flush();
+    }
+
+    int register_static_log(static_log_info info)
+    {
+        int log_id = UNASSIGNED_LOGID;
+        register_log(info, log_id);
+        return log_id;
     }
 
     void set_log_file(const char *filename)
@@ -54,6 +90,80 @@ class fast_logger
         log_handler_.set_log_file(filename);
     }
 
+    void set_binary_log_file(const char *filename)
+    {
+        log_handler_.set_binary_log_file(filename);
+    }
+
+    // the logger owns sink afterwards
+    void set_log_sink(log_sink *sink)
+    {
+        log_handler_.set_log_sink(sink);
+    }
+
+    void set_binary_log_sink(log_sink *sink)
+    {
+        log_handler_.set_binary_log_sink(sink);
+    }
+
+    // applies to staging buffers allocated afterwards
+    void set_staging_buffer_options(const staging_buffer_options &opts)
+    {
+        buffer_opts_ = opts;
+    }
+
+    // allocate the calling thread's staging buffer up front, e.g. to give a hot
+    // thread a bigger queue than the default
+    void preallocate(const staging_buffer_options &opts)
+    {
+        ensure_staging_buffer_allocated(opts);
+    }
+    void preallocate()
+    {
+        ensure_staging_buffer_allocated(buffer_opts_);
+    }
+
+    // set before polling starts
+    void set_drain_order(drain_order order)
+    {
+        drain_order_ = order;
+    }
+
+    // Text lines of each thread go to <prefix>.<thread name>.log instead of
+    // the log file. Set before polling starts, not for binary logs.
+    void set_per_thread_log_files(const char *prefix)
+    {
+        thread_file_prefix_ = prefix;
+    }
+
+    // Drain and format on n worker threads, each owning a share of the
+    // staging buffers. The poller merges their text chunks by timestamp and
+    // writes them, 0 does everything on the poller. Binary logs and
+    // per-thread files are always written by the poller.
+    void set_format_workers(uint32_t n)
+    {
+        lock_poll();
+        set_pipeline(n);
+        unlock_poll();
+    }
+
+    // sub-second digits and time zone of the line prefix
+    void set_time_format(time_precision precision, bool utc = false)
+    {
+        lock_poll();
+        // the workers take the format when they start
+        uint32_t n = pipeline_ ? pipeline_->worker_count() : 0;
+        set_pipeline(0);
+        log_handler_.set_time_format(precision, utc);
+        set_pipeline(n);
+        unlock_poll();
+    }
+
+    // Keep up to max_cnt drained buffers of exited threads and hand them to new
+    // threads instead of allocating, prefault_cnt buffers with the current
+    // staging buffer options are allocated up front.
+    void set_buffer_pool(size_t max_cnt, size_t prefault_cnt = 0);
+
     void set_log_level(log_level logLevel)
     {
         cur_level_ = logLevel;
@@ -63,26 +173,175 @@ class fast_logger
     {
         return cur_level_;
     }
-    void poll()
+    // one entry per live thread buffer, exited threads are summed up in the
+    // last entry named "retired"
+    std::vector<staging_buffer_stats> get_stats();
+
+    // let the poller write get_stats() to the log every interval_ns, 0 disables
+    void set_stats_interval(int64_t interval_ns)
     {
-        poll_inner();
+        stats_interval_tsc_ = static_cast<int64_t>(interval_ns * tscns_.getTscGhz());
+    }
+
+    // the poller recalibrates tsc2ns against the system clock every
+    // interval_ns, 3s by default, 0 disables
+    void set_tsc_calibrate_interval(int64_t interval_ns)
+    {
+        lock_poll();
+        tscns_.setCalibrateInterval(interval_ns);
+        unlock_poll();
+    }
+
+    // write a line with the observed drift on every calibration
+    void set_log_calibrations(bool enable)
+    {
+        log_calibrations_ = enable;
+    }
+
+    tscns_stats get_tsc_stats()
+    {
+        tscns_stats stats;
+        tscns_.getStats(stats);
+        return stats;
+    }
+
+    // returns the number of messages handled
+    size_t poll()
+    {
+        lock_poll();
+        size_t cnt = poll_inner(false);
+        unlock_poll();
+        return cnt;
+    }
+
+    // writes everything logged so far and flushes the sink, waits for a poll
+    // running on another thread. FATAL logs call it before returning.
+    void flush()
+    {
+        lock_poll();
+        poll_inner(false);
+        if (pipeline_)
+            poll_pipeline(tscns_.rdtsc(), true);
+        log_handler_.flush();
+        for (auto &it : thread_sinks_) {
+            it.second->flush();
+        }
+        unlock_poll();
+    }
+
+    // Opt-in: on SIGSEGV, SIGABRT, SIGBUS, SIGFPE, SIGILL and SIGTERM drain
+    // every staging buffer with async-signal-safe calls only, then hand the
+    // signal to the previous handler. Also drains from an atexit hook.
+    static void install_crash_handler();
+
+    // the signal safe drain, public for custom signal handlers
+    void crash_drain();
+
+    // run poll() on a dedicated backend thread instead of the application loop
+    bool start_backend(const backend_options &opts = backend_options())
+    {
+        if (backend_.running())
+            return false;
+        if (!backend_task_id_) {
+            backend_task_id_ = backend_.add_task([this] { return poll(); });
+        }
+        return backend_.start(opts);
+    }
+
+    void stop_backend()
+    {
+        backend_.stop();
     }
 
   private:
-    fast_logger() : log_handler_(tscns_)
+    fast_logger() : tscns_(TSCNS::global()), log_handler_(tscns_)
     {
-        tscns_.init();
+        tscns_.initOnce();
+        log_handler_.reserve_log_infos(LOG_INFO_ROOM);
+        strncpy(retired_stats_.name, "retired", sizeof(retired_stats_.name));
     }
 
   private:
+    template <typename... Ts>
+    inline void write_log(const int log_id, Ts... args)
+    {
+        uint64_t timestamp                       = tscns_.rdtsc();
+        size_t   string_sizes[sizeof...(Ts) + 1] = {}; // HACK: Zero length arrays are not allowed
+        size_t   arg_size                        = details::get_arg_sizes(string_sizes, args...);
+        if (staging_buffer_ == nullptr) {
+            ensure_staging_buffer_allocated(buffer_opts_);
+        }
+        if (staging_buffer_->compact_records() && staging_buffer_->write_compact(log_id, timestamp, arg_size, string_sizes, args...))
+            return;
+        auto header = staging_buffer_->alloc(arg_size + sizeof(timestamp), string_sizes);
+        if (!header)
+            return;
+        header->userdata       = log_id;
+        char *write_pos        = (char *)(header + 1);
+        *(uint64_t *)write_pos = timestamp;
+        write_pos += sizeof(timestamp);
+        details::store_arguments(string_sizes, &write_pos, args...);
+        staging_buffer_->finish();
+    }
+
     /////////////////////////////////////////////////////////////////
-    void                          ensure_staging_buffer_allocated();
-    staging_buffer::queue_header *alloc(size_t size);
-    void                          finish();
+    void                          ensure_staging_buffer_allocated(const staging_buffer_options &opts);
 
     void register_log(static_log_info &info, int &log_id);
+    void retire_stats(staging_buffer *tb);
+    void write_stats();
+    void write_calibration();
+    void release_buffer(staging_buffer *tb);
+    log_sink *thread_sink(staging_buffer *tb, bool crash);
+    size_t drain_ordered(int64_t tsc, bool crash);
+    size_t drain_unordered(int64_t tsc, bool crash);
+    void drain_raw(bool front_only);
+    size_t drain_buffer_raw(staging_buffer *tb, bool front_only);
+    void push_heap(staging_buffer *tb, const staging_buffer::queue_header *header);
     void adjust_heap(size_t i);
-    void poll_inner();
+    void take_registered_buffers(bool crash);
+    void set_pipeline(uint32_t n);
+    size_t poll_pipeline(int64_t tsc, bool wait);
+    staging_buffer *take_pooled_buffer(const staging_buffer_options &opts);
+    bool recycle_buffer(staging_buffer *tb);
+    size_t poll_inner(bool crash);
+
+    void lock_poll()
+    {
+        while (poll_lock_.exchange(true, std::memory_order_acquire)) {
+            details::cpu_relax();
+        }
+        poll_owner_ = pthread_self();
+    }
+    void unlock_poll()
+    {
+        poll_owner_ = 0;
+        poll_lock_.store(false, std::memory_order_release);
+    }
+
+    // a spin lock rather than a mutex, the crash drain tries it from a
+    // signal handler
+    void lock_stats()
+    {
+        while (stats_lock_.exchange(true, std::memory_order_acquire)) {
+            details::cpu_relax();
+        }
+    }
+    void unlock_stats()
+    {
+        stats_lock_.store(false, std::memory_order_release);
+    }
+
+    void lock_pool()
+    {
+        while (pool_lock_.exchange(true, std::memory_order_acquire)) {
+            details::cpu_relax();
+        }
+    }
+    void unlock_pool()
+    {
+        pool_lock_.store(false, std::memory_order_release);
+    }
 
   private:
     class staging_buffer_destroyer
@@ -105,27 +364,56 @@ class fast_logger
     };
 
   private:
+    // call sites the dictionary can take without allocating, kept free for
+    // the crash drain
+    static constexpr size_t LOG_INFO_ROOM = 256;
+
     struct heap_node
     {
-        heap_node(staging_buffer *buffer) : tb(buffer)
+        heap_node(staging_buffer *buffer, const staging_buffer::queue_header *front) : tb(buffer), header(front)
         {
         }
 
         staging_buffer                     *tb;
-        const staging_buffer::queue_header *header{nullptr};
+        const staging_buffer::queue_header *header;
     };
-    std::vector<heap_node> bg_thread_buffers_;
+    // buffers with queued messages, a min heap on the front's timestamp
+    std::vector<heap_node>        bg_thread_buffers_;
+    // buffers found empty, checked for new messages on every poll, all
+    // buffers with DRAIN_UNORDERED. Both have room for every buffer, so the
+    // crash drain can move buffers between them without allocating.
+    std::vector<staging_buffer *> idle_buffers_;
 
   private:
     log_level                                    cur_level_{log_level::TRACE};
+    staging_buffer_options                       buffer_opts_;
     std::vector<static_log_info>                 log_infos_;
     static thread_local staging_buffer          *staging_buffer_;
     static thread_local staging_buffer_destroyer sbc_;
-    std::vector<staging_buffer *>                thread_buffers_;
+    // buffers of new threads, pushed lock-free, taken as a whole by the poller
+    std::atomic<staging_buffer *>                registered_buffers_{nullptr};
     std::mutex                                   register_mutex_;
-    std::mutex                                   buffer_mutex_;
-    TSCNS                                        tscns_;
+    std::atomic<bool>                            stats_lock_{false};
+    std::vector<staging_buffer *>                stats_buffers_;
+    staging_buffer_stats                         retired_stats_{};
+    int64_t                                      stats_interval_tsc_{0};
+    int64_t                                      next_stats_tsc_{0};
+    bool                                         log_calibrations_{false};
+    TSCNS                                       &tscns_;
     log_handler                                  log_handler_;
+    backend_thread                               backend_;
+    uint32_t                                     backend_task_id_{0};
+    std::atomic<bool>                            poll_lock_{false};
+    volatile pthread_t                           poll_owner_{0};
+    std::atomic<bool>                            crashed_{false};
+    std::vector<staging_buffer *>                buffer_pool_;
+    size_t                                       buffer_pool_max_{0};
+    std::atomic<bool>                            pool_lock_{false};
+    drain_order                                  drain_order_{DRAIN_ORDERED};
+    std::string                                  thread_file_prefix_;
+    std::unique_ptr<format_pipeline>             pipeline_;
+
+    std::unordered_map<staging_buffer *, log_sink *> thread_sinks_;
 };
 
 #define FAST_LOG(level, format, ...)                                                                                                                 \
@@ -138,6 +426,37 @@ class fast_logger
         fast_logger::get_logger().log(log_id, __LINE__, level, format, n_params, ##__VA_ARGS__);                                                     \
     } while (0)
 
+// The id of a FAST_LOG_STATIC call site. Site is a local type unique to the
+// call site, instantiating the template registers it during static
+// initialization, i.e. before main. Logging from other static initializers
+// must use FAST_LOG, the id may not be assigned yet.
+template <typename Site>
+struct static_log_site
+{
+    static const int id;
+};
+template <typename Site>
+const int static_log_site<Site>::id = fast_logger::get_logger().register_static_log(Site::info());
+
+// Like FAST_LOG without the registration check on the hot path, level has to
+// be a constant.
+#define FAST_LOG_STATIC(level, format, ...)                                                                                                          \
+    do {                                                                                                                                             \
+        constexpr int n_params = details::count_fmt_params(format);                                                                                  \
+        if (false) {                                                                                                                                 \
+            details::check_format(format, ##__VA_ARGS__);                                                                                            \
+        }                                                                                                                                            \
+        using fast_log_layout = decltype(details::make_arg_layout(__VA_ARGS__));                                                                     \
+        struct fast_log_site                                                                                                                         \
+        {                                                                                                                                            \
+            static constexpr static_log_info info()                                                                                                  \
+            {                                                                                                                                        \
+                return static_log_info(__LINE__, level, format, static_cast<uint8_t>(details::count_fmt_params(format)), fast_log_layout::sizes);    \
+            }                                                                                                                                        \
+        };                                                                                                                                           \
+        fast_logger::get_logger().log_registered(static_log_site<fast_log_site>::id, level, n_params, ##__VA_ARGS__);                                \
+    } while (0)
+
 #define POLL()                                                                                                                                       \
     do {                                                                                                                                             \
         fast_logger::get_logger().poll();                                                                                                            \
@@ -1,41 +1,122 @@
 #pragma once
+#include "log_sink.h"
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <mutex>
+#include <pthread.h>
+#include <spawn.h>
+#include <stdint.h>
 #include <stdio.h>
+#include <string.h>
+#include <string>
+#include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/wait.h>
+#include <thread>
+#include <time.h>
+#include <unistd.h>
+#include <vector>
 
-class file_appender
+struct rotation_options
+{
+    // rotate before the file grows past max_bytes, 0 disables
+    uint64_t max_bytes{0};
+    // rotate every day at daily_hour:daily_minute local time, -1 disables
+    int      daily_hour{-1};
+    int      daily_minute{0};
+    // rotated files kept next to the current one, 0 keeps all
+    uint32_t max_files{0};
+    // gzip rotated files
+    bool     compress{false};
+    // fallocate the pre-opened next file
+    uint64_t preallocate_bytes{0};
+};
+
+// Appends to filename through a 64 KiB buffer. With rotation enabled the
+// current file is renamed to filename.YYYYmmdd-HHMMSS on rotation. A helper
+// thread opens the next file ahead of time and closes, renames and
+// compresses the old one, so the poller only swaps the fd.
+class file_appender : public log_sink
 {
   public:
-    explicit file_appender(const char *filename) : fp_(::fopen(filename, "ae")), written_bytes_(0)
+    explicit file_appender(const char *filename, const rotation_options &opts = rotation_options())
+        : filename_(filename), next_filename_(filename_ + ".next"), opts_(opts), written_bytes_(0)
     {
-        ::setbuffer(fp_, buffer_, sizeof buffer_);
+        fd_ = ::open(filename, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+        if (fd_ < 0) {
+            fprintf(stderr, "file_appender: open %s failed %d\n", filename, errno);
+        }
+        struct stat st;
+        if (fd_ >= 0 && ::fstat(fd_, &st) == 0) {
+            file_bytes_ = st.st_size;
+        }
+        rotating_ = opts_.max_bytes || opts_.daily_hour >= 0;
+        if (opts_.daily_hour >= 0) {
+            next_rotate_sec_.store(next_daily_boundary(coarse_now()), std::memory_order_relaxed);
+        }
+        if (rotating_) {
+            helper_ = std::thread(&file_appender::helper_loop, this);
+        }
     }
     ~file_appender()
     {
-        ::fclose(fp_);
+        flush();
+        if (helper_.joinable()) {
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                stop_ = true;
+            }
+            cv_.notify_all();
+            helper_.join();
+        }
+        int next = next_fd_.exchange(-1);
+        if (next >= 0) {
+            ::close(next);
+            ::unlink(next_filename_.c_str());
+        }
+        if (fd_ >= 0) {
+            if (opts_.preallocate_bytes && ::ftruncate(fd_, file_bytes_) != 0) {
+                fprintf(stderr, "file_appender: ftruncate failed %d\n", errno);
+            }
+            ::close(fd_);
+        }
     }
 
-    void append(const char *logline, const size_t len)
+    file_appender(const file_appender &)            = delete;
+    file_appender &operator=(const file_appender &) = delete;
+
+    void append(const char *logline, const size_t len) override
     {
-        size_t n      = write(logline, len);
-        size_t remain = len - n;
-        while (remain > 0) {
-            size_t x = write(logline + n, remain);
-            if (x == 0) {
-                int err = ferror(fp_);
-                if (err) {
-                    fprintf(stderr, "file_appender::append() failed %d\n", err);
-                }
-                break;
+        if (rotating_ && !crash_)
+            check_rotate(len);
+        if (buffer_len_ + len > sizeof(buffer_)) {
+            flush_buffer();
+            if (len > sizeof(buffer_)) {
+                write_fd(logline, len);
+                written_bytes_ += len;
+                file_bytes_ += len;
+                return;
             }
-            n += x;
-            remain = len - n; // remain -= x
         }
+        memcpy(buffer_ + buffer_len_, logline, len);
+        buffer_len_ += len;
         written_bytes_ += len;
+        file_bytes_ += len;
     }
 
-    void flush()
+    void flush() override
+    {
+        flush_buffer();
+    }
+    // rotation takes locks, stay on the current file
+    void enter_crash_mode() override
     {
-        ::fflush(fp_);
+        crash_ = true;
     }
     off_t writtenBytes() const
     {
@@ -43,11 +124,244 @@ class file_appender
     }
 
   private:
-    size_t write(const char *logline, size_t len)
+    struct retired_file
+    {
+        int   fd;
+        off_t size;
+    };
+
+    static int64_t coarse_now()
+    {
+        timespec ts;
+        ::clock_gettime(CLOCK_REALTIME_COARSE, &ts);
+        return ts.tv_sec;
+    }
+
+    int64_t next_daily_boundary(time_t now) const
+    {
+        struct tm tm_time;
+        ::localtime_r(&now, &tm_time);
+        tm_time.tm_hour  = opts_.daily_hour;
+        tm_time.tm_min   = opts_.daily_minute;
+        tm_time.tm_sec   = 0;
+        tm_time.tm_isdst = -1;
+        time_t t         = ::mktime(&tm_time);
+        if (t <= now) {
+            tm_time.tm_mday++;
+            tm_time.tm_isdst = -1;
+            t                = ::mktime(&tm_time);
+        }
+        return t;
+    }
+
+    void check_rotate(size_t len)
+    {
+        bool by_size = opts_.max_bytes && file_bytes_ && file_bytes_ + len > opts_.max_bytes;
+        bool by_time = coarse_now() >= next_rotate_sec_.load(std::memory_order_relaxed);
+        if (!by_size && !by_time)
+            return;
+        // the helper did not finish the previous rotation yet, keep writing
+        // to the current file and try again with the next line
+        int next = next_fd_.exchange(-1);
+        if (next < 0)
+            return;
+        flush_buffer();
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            retired_.push_back(retired_file{fd_, file_bytes_});
+        }
+        cv_.notify_all();
+        fd_         = next;
+        file_bytes_ = 0;
+        // mktime may read the time zone, the helper computes the next boundary
+        if (by_time) {
+            next_rotate_sec_.store(INT64_MAX, std::memory_order_relaxed);
+        }
+    }
+
+    void flush_buffer()
+    {
+        if (buffer_len_) {
+            write_fd(buffer_, buffer_len_);
+            buffer_len_ = 0;
+        }
+    }
+
+    void write_fd(const char *data, size_t len)
+    {
+        while (len > 0) {
+            ssize_t n = ::write(fd_, data, len);
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n <= 0) {
+                report_error("file_appender::append()", errno);
+                return;
+            }
+            data += n;
+            len -= n;
+        }
+    }
+
+    /////////////////////////////////////////////////////////////////
+    // helper thread
+
+    void helper_loop()
     {
-        return ::fwrite_unlocked(logline, 1, len, fp_);
+        pthread_setname_np(pthread_self(), "fast_logger_rot");
+        prepare_next();
+        std::unique_lock<std::mutex> lock(mutex_);
+        while (true) {
+            cv_.wait(lock, [this] { return stop_ || !retired_.empty(); });
+            if (retired_.empty())
+                break;
+            retired_file f = retired_.front();
+            retired_.pop_front();
+            lock.unlock();
+            retire(f);
+            prepare_next();
+            lock.lock();
+        }
+    }
+
+    void prepare_next()
+    {
+        // lines in it come from a run that died between the fd swap and the
+        // rename, they were the live file then and are kept as an archive
+        struct stat st;
+        if (::stat(next_filename_.c_str(), &st) == 0 && st.st_size > 0) {
+            std::string archive = archive_name();
+            if (::rename(next_filename_.c_str(), archive.c_str()) != 0) {
+                fprintf(stderr, "file_appender: rename %s failed %d\n", next_filename_.c_str(), errno);
+                return;
+            }
+        }
+        int fd = ::open(next_filename_.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+        if (fd < 0) {
+            fprintf(stderr, "file_appender: open %s failed %d\n", next_filename_.c_str(), errno);
+            return;
+        }
+        if (opts_.preallocate_bytes) {
+            ::fallocate(fd, FALLOC_FL_KEEP_SIZE, 0, opts_.preallocate_bytes);
+        }
+        if (opts_.daily_hour >= 0) {
+            next_rotate_sec_.store(next_daily_boundary(coarse_now()), std::memory_order_relaxed);
+        }
+        next_fd_.store(fd, std::memory_order_release);
+    }
+
+    void retire(const retired_file &f)
+    {
+        // give back the preallocated blocks past the end
+        if (opts_.preallocate_bytes && ::ftruncate(f.fd, f.size) != 0) {
+            fprintf(stderr, "file_appender: ftruncate failed %d\n", errno);
+        }
+        ::close(f.fd);
+        std::string archive = archive_name();
+        if (::rename(filename_.c_str(), archive.c_str()) != 0) {
+            fprintf(stderr, "file_appender: rename %s failed %d\n", filename_.c_str(), errno);
+        }
+        if (::rename(next_filename_.c_str(), filename_.c_str()) != 0) {
+            fprintf(stderr, "file_appender: rename %s failed %d\n", next_filename_.c_str(), errno);
+        }
+        if (opts_.compress) {
+            compress(archive);
+        }
+        if (opts_.max_files) {
+            remove_old_files();
+        }
+    }
+
+    std::string archive_name() const
+    {
+        time_t    now = ::time(nullptr);
+        struct tm tm_time;
+        ::localtime_r(&now, &tm_time);
+        char suffix[32];
+        strftime(suffix, sizeof(suffix), ".%Y%m%d-%H%M%S", &tm_time);
+        std::string name = filename_ + suffix;
+        std::string ret  = name;
+        for (int i = 1; ::access(ret.c_str(), F_OK) == 0 || ::access((ret + ".gz").c_str(), F_OK) == 0; i++) {
+            ret = name + "." + std::to_string(i);
+        }
+        return ret;
+    }
+
+    static void compress(const std::string &path)
+    {
+        const char *argv[] = {"gzip", "-f", path.c_str(), nullptr};
+        pid_t       pid;
+        if (posix_spawnp(&pid, "gzip", nullptr, nullptr, const_cast<char *const *>(argv), environ) != 0) {
+            fprintf(stderr, "file_appender: failed to run gzip on %s\n", path.c_str());
+            return;
+        }
+        int status;
+        while (::waitpid(pid, &status, 0) < 0 && errno == EINTR) {
+        }
+    }
+
+    // rotated files are <filename>.YYYYmmdd-HHMMSS[.N][.gz]
+    static bool is_archive(const char *name, const std::string &base)
+    {
+        if (strncmp(name, base.c_str(), base.size()) != 0 || name[base.size()] != '.')
+            return false;
+        const char *p = name + base.size() + 1;
+        for (int i = 0; i < 15; i++) {
+            if (i == 8 ? p[i] != '-' : (p[i] < '0' || p[i] > '9'))
+                return false;
+        }
+        return true;
+    }
+
+    void remove_old_files()
+    {
+        size_t      slash = filename_.rfind('/');
+        std::string dir   = slash == std::string::npos ? "." : filename_.substr(0, slash + 1);
+        std::string base  = slash == std::string::npos ? filename_ : filename_.substr(slash + 1);
+        DIR        *d     = ::opendir(dir.c_str());
+        if (!d)
+            return;
+        std::vector<std::pair<timespec, std::string>> files;
+        while (dirent *e = ::readdir(d)) {
+            if (!is_archive(e->d_name, base))
+                continue;
+            std::string path = slash == std::string::npos ? e->d_name : dir + e->d_name;
+            struct stat st;
+            if (::stat(path.c_str(), &st) == 0) {
+                files.emplace_back(st.st_mtim, path);
+            }
+        }
+        ::closedir(d);
+        if (files.size() <= opts_.max_files)
+            return;
+        std::sort(files.begin(), files.end(), [](const std::pair<timespec, std::string> &a, const std::pair<timespec, std::string> &b) {
+            if (a.first.tv_sec != b.first.tv_sec)
+                return a.first.tv_sec < b.first.tv_sec;
+            if (a.first.tv_nsec != b.first.tv_nsec)
+                return a.first.tv_nsec < b.first.tv_nsec;
+            return a.second < b.second;
+        });
+        for (size_t i = 0; i + opts_.max_files < files.size(); i++) {
+            ::unlink(files[i].second.c_str());
+        }
     }
-    FILE *fp_;
-    char  buffer_[64 * 1024];
-    off_t written_bytes_;
+
+  private:
+    std::string      filename_;
+    std::string      next_filename_;
+    rotation_options opts_;
+    int              fd_{-1};
+    char             buffer_[64 * 1024];
+    size_t           buffer_len_{0};
+    off_t            written_bytes_;
+    off_t            file_bytes_{0};
+    bool             rotating_{false};
+    bool             crash_{false};
+
+    std::atomic<int64_t>     next_rotate_sec_{INT64_MAX};
+    std::atomic<int>         next_fd_{-1};
+    std::mutex               mutex_;
+    std::condition_variable  cv_;
+    std::deque<retired_file> retired_;
+    bool                     stop_{false};
+    std::thread              helper_;
 };
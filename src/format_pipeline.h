@@ -0,0 +1,517 @@
+#pragma once
+#include "log_handler.h"
+#include "staging_buffer.h"
+#include "tscns.h"
+#include "utils.h"
+#include <algorithm>
+#include <atomic>
+#include <linux/futex.h>
+#include <memory>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <thread>
+#include <time.h>
+#include <unistd.h>
+#include <vector>
+
+// Formats text lines on worker threads without giving up the poller's order.
+// Every staging buffer belongs to one worker, which drains its rings itself.
+// Each poll publishes an epoch, a tsc cutoff: every worker formats the
+// records of its buffers logged before the cutoff, in timestamp order, into
+// a text chunk with the timestamp and end of each line. The poller merges the
+// chunks of an epoch by those timestamps and writes runs of lines, it never
+// touches a record.
+class format_pipeline
+{
+  public:
+    format_pipeline(TSCNS &tscns, log_handler &out, uint32_t worker_cnt) : out_(out)
+    {
+        for (uint32_t i = 0; i < worker_cnt; i++) {
+            workers_.emplace_back(new worker(tscns));
+            workers_.back()->handler.set_time_format(out.get_time_precision(), out.is_utc());
+        }
+        for (uint32_t i = 0; i < worker_cnt; i++) {
+            workers_[i]->thread = std::thread(&format_pipeline::work, this, i);
+        }
+    }
+    ~format_pipeline()
+    {
+        write_ready(true);
+        stop_workers();
+        for (auto &w : workers_) {
+            for (auto &c : w->chunks) {
+                free(c.text);
+            }
+        }
+    }
+
+    format_pipeline(const format_pipeline &)            = delete;
+    format_pipeline &operator=(const format_pipeline &) = delete;
+
+    uint32_t worker_count() const
+    {
+        return static_cast<uint32_t>(workers_.size());
+    }
+
+    /////////////////////////////////////////////////////////////////
+    // poller side
+
+    // the worker with the fewest buffers takes it with the next epoch
+    void add_buffer(staging_buffer *tb)
+    {
+        worker *least = workers_[0].get();
+        for (auto &w : workers_) {
+            if (w->buffer_cnt < least->buffer_cnt)
+                least = w.get();
+        }
+        least->pending.push_back(tb);
+        least->buffer_cnt++;
+    }
+
+    // Writes the epochs formatted so far and publishes one up to tsc when a
+    // slot is free. With wait, everything logged before tsc is written on
+    // return. Returns the number of lines written.
+    size_t poll(int64_t tsc, bool ordered, bool wait)
+    {
+        size_t cnt = write_ready(wait);
+        if (fill_seq_ - write_seq_ < DEPTH) {
+            publish(tsc, ordered);
+        }
+        if (wait)
+            cnt += write_ready(true);
+        return cnt;
+    }
+
+    // writes the finished epochs, all published ones with wait_all
+    size_t write_ready(bool wait_all)
+    {
+        size_t cnt = 0;
+        while (write_seq_ != fill_seq_ && (wait_all || epoch_done(write_seq_))) {
+            cnt += write_epoch(write_seq_, false);
+            for (auto &w : workers_) {
+                chunk &c = w->chunks[slot(write_seq_)];
+                released_.insert(released_.end(), c.released.begin(), c.released.end());
+                w->buffer_cnt -= c.released.size();
+                c.released.clear();
+                c.text_len = 0;
+                c.line_cnt = 0;
+                c.lines.clear();
+                c.state.store(CHUNK_EMPTY, std::memory_order_release);
+            }
+            epochs_[slot(write_seq_)].new_infos.clear();
+            write_seq_++;
+        }
+        return cnt;
+    }
+
+    // buffers of exited threads the workers drained, the owner releases them
+    std::vector<staging_buffer *> &released()
+    {
+        return released_;
+    }
+
+    // stops the workers and hands every buffer back to the owner, call
+    // after poll with wait
+    std::vector<staging_buffer *> take_buffers()
+    {
+        stop_workers();
+        std::vector<staging_buffer *> buffers;
+        for (auto &w : workers_) {
+            buffers.insert(buffers.end(), w->buffers.begin(), w->buffers.end());
+            buffers.insert(buffers.end(), w->pending.begin(), w->pending.end());
+            w->buffers.clear();
+            w->pending.clear();
+            w->buffer_cnt = 0;
+        }
+        return buffers;
+    }
+
+    // Signal safe. Asks the workers to stop at the next record and waits a
+    // moment for them, false if one did not stop, e.g. because the crash
+    // happened on it.
+    bool park_workers()
+    {
+        crash_.store(true, std::memory_order_seq_cst);
+        for (auto &w : workers_) {
+            for (auto &c : w->chunks) {
+                syscall(SYS_futex, reinterpret_cast<uint32_t *>(&c.state), FUTEX_WAKE_PRIVATE, INT32_MAX, nullptr, nullptr, 0);
+            }
+        }
+        bool all = true;
+        for (auto &w : workers_) {
+            for (int i = 0; !w->parked.load(std::memory_order_acquire); i++) {
+                if (i == (1 << 22) || pthread_equal(w->thread.native_handle(), pthread_self())) {
+                    all = false;
+                    break;
+                }
+                details::cpu_relax();
+            }
+        }
+        return all;
+    }
+
+    // Signal safe, through the output handler, which should be in signal
+    // safe mode. Writes what the parked workers formatted, then drains the
+    // records left in their rings on the calling thread. The buffers of a
+    // worker that did not stop are left alone.
+    void crash_flush()
+    {
+        park_workers();
+        for (; write_seq_ != fill_seq_; write_seq_++) {
+            write_epoch(write_seq_, true);
+        }
+        for (auto &w : workers_) {
+            if (!w->parked.load(std::memory_order_acquire))
+                continue;
+            for (auto tb : w->buffers) {
+                drain_parked(tb);
+            }
+            for (auto &c : w->chunks) {
+                for (auto tb : c.added) {
+                    drain_parked(tb);
+                }
+            }
+            for (auto tb : w->pending) {
+                drain_parked(tb);
+            }
+        }
+    }
+
+  private:
+    enum chunk_state : uint32_t
+    {
+        CHUNK_EMPTY  = 0,
+        CHUNK_FILLED = 1,
+        CHUNK_DONE   = 2,
+    };
+
+    struct line_meta
+    {
+        int64_t tsc;
+        // end of the line in the chunk's text
+        size_t  end;
+    };
+
+    // what a worker formatted for one epoch
+    struct chunk
+    {
+        std::atomic<uint32_t>         state{CHUNK_EMPTY};
+        // poller to worker, buffers it takes over with this epoch
+        std::vector<staging_buffer *> added;
+        char                         *text{nullptr};
+        size_t                        text_len{0};
+        size_t                        text_cap{0};
+        // one per line, ordered epochs only
+        std::vector<line_meta>        lines;
+        size_t                        line_cnt{0};
+        // worker to poller, drained buffers of exited threads
+        std::vector<staging_buffer *> released;
+    };
+
+    struct epoch
+    {
+        int64_t                      tsc{0};
+        bool                         ordered{true};
+        // dictionary entries added since the previous epoch, every worker
+        // takes all of them
+        std::vector<static_log_info> new_infos;
+    };
+
+    struct heap_node
+    {
+        int64_t         tsc;
+        staging_buffer *tb;
+    };
+
+    static constexpr size_t DEPTH    = 2;
+    static constexpr int    SPIN_CNT = 1024;
+
+    struct worker
+    {
+        explicit worker(TSCNS &tscns) : handler(tscns, false)
+        {
+        }
+
+        log_handler                   handler;
+        std::thread                   thread;
+        std::atomic<bool>             waiting{false};
+        std::atomic<bool>             parked{false};
+        chunk                         chunks[DEPTH];
+        // worker side, the buffers it drains and its merge heap
+        std::vector<staging_buffer *> buffers;
+        std::vector<heap_node>        heap;
+        // poller side, buffers for the next epoch, buffers owned, dictionary
+        // entries handed over and the merge cursor
+        std::vector<staging_buffer *> pending;
+        size_t                        buffer_cnt{0};
+        size_t                        cur_line{0};
+        size_t                        cur_off{0};
+    };
+
+    static size_t slot(uint64_t seq)
+    {
+        return seq % DEPTH;
+    }
+
+    static int64_t msg_tsc(const staging_buffer::queue_header *header)
+    {
+        return *(const int64_t *)(header + 1);
+    }
+
+    void publish(int64_t tsc, bool ordered)
+    {
+        epoch &ep  = epochs_[slot(fill_seq_)];
+        ep.tsc     = tsc;
+        ep.ordered = ordered;
+        for (size_t cnt = out_.get_log_infos_cnt(); infos_sent_ < cnt; infos_sent_++) {
+            ep.new_infos.push_back(out_.get_log_info(infos_sent_));
+        }
+        for (auto &w : workers_) {
+            chunk &c = w->chunks[slot(fill_seq_)];
+            c.added.swap(w->pending);
+            c.state.store(CHUNK_FILLED, std::memory_order_seq_cst);
+            if (w->waiting.load(std::memory_order_seq_cst)) {
+                syscall(SYS_futex, reinterpret_cast<uint32_t *>(&c.state), FUTEX_WAKE_PRIVATE, 1, nullptr, nullptr, 0);
+            }
+        }
+        fill_seq_++;
+    }
+
+    bool epoch_done(uint64_t seq)
+    {
+        for (auto &w : workers_) {
+            if (w->chunks[slot(seq)].state.load(std::memory_order_acquire) != CHUNK_DONE)
+                return false;
+        }
+        return true;
+    }
+
+    // Merges the chunks of an epoch, runs of lines of one chunk that stay
+    // below the other chunks' next lines go out in one write. In a crash the
+    // chunks of parked workers are written as far as they got.
+    size_t write_epoch(uint64_t seq, bool crash)
+    {
+        size_t cnt = 0;
+        for (auto &w : workers_) {
+            chunk &c = w->chunks[slot(seq)];
+            while (!crash && c.state.load(std::memory_order_acquire) != CHUNK_DONE) {
+                details::cpu_relax();
+            }
+            w->cur_line = 0;
+            w->cur_off  = 0;
+        }
+        auto usable = [&](worker &w) {
+            return !crash || w.chunks[slot(seq)].state.load(std::memory_order_acquire) == CHUNK_DONE || w.parked.load(std::memory_order_acquire);
+        };
+        if (!epochs_[slot(seq)].ordered) {
+            for (auto &w : workers_) {
+                chunk &c = w->chunks[slot(seq)];
+                if (usable(*w) && c.text_len) {
+                    out_.write_output(c.text, c.text_len);
+                    cnt += c.line_cnt;
+                }
+            }
+            return cnt;
+        }
+        while (true) {
+            worker *first  = nullptr;
+            int64_t second = INT64_MAX;
+            for (auto &w : workers_) {
+                chunk &c = w->chunks[slot(seq)];
+                if (!usable(*w) || w->cur_line == c.lines.size())
+                    continue;
+                int64_t tsc = c.lines[w->cur_line].tsc;
+                if (!first || tsc < first->chunks[slot(seq)].lines[first->cur_line].tsc) {
+                    if (first)
+                        second = std::min(second, first->chunks[slot(seq)].lines[first->cur_line].tsc);
+                    first = w.get();
+                } else {
+                    second = std::min(second, tsc);
+                }
+            }
+            if (!first)
+                break;
+            chunk &c   = first->chunks[slot(seq)];
+            size_t end = first->cur_line;
+            while (end < c.lines.size() && c.lines[end].tsc <= second) {
+                end++;
+            }
+            out_.write_output(c.text + first->cur_off, c.lines[end - 1].end - first->cur_off);
+            cnt += end - first->cur_line;
+            first->cur_off  = c.lines[end - 1].end;
+            first->cur_line = end;
+        }
+        return cnt;
+    }
+
+    void stop_workers()
+    {
+        if (stop_.exchange(true, std::memory_order_seq_cst))
+            return;
+        for (auto &w : workers_) {
+            for (auto &c : w->chunks) {
+                syscall(SYS_futex, reinterpret_cast<uint32_t *>(&c.state), FUTEX_WAKE_PRIVATE, INT32_MAX, nullptr, nullptr, 0);
+            }
+        }
+        for (auto &w : workers_) {
+            w->thread.join();
+        }
+        // buffers handed over with epochs the workers did not get to
+        for (auto &w : workers_) {
+            for (auto &c : w->chunks) {
+                w->buffers.insert(w->buffers.end(), c.added.begin(), c.added.end());
+                c.added.clear();
+            }
+        }
+    }
+
+    // the crash thread takes over the rings of a parked worker
+    void drain_parked(staging_buffer *tb)
+    {
+        size_t info_cnt = out_.get_log_infos_cnt();
+        for (auto h = tb->front(); h && staging_buffer::log_id(h) < info_cnt; h = tb->front()) {
+            out_.handle_log(tb->get_name(), h);
+            tb->pop(h);
+        }
+    }
+
+    /////////////////////////////////////////////////////////////////
+    // worker threads
+
+    void work(uint32_t id)
+    {
+        pthread_setname_np(pthread_self(), "fast_logger_fmt");
+        worker &w = *workers_[id];
+        for (uint64_t seq = 0;; seq++) {
+            chunk &c = w.chunks[slot(seq)];
+            if (!wait_filled(w, c))
+                break;
+            epoch &ep = epochs_[slot(seq)];
+            for (auto &info : ep.new_infos) {
+                w.handler.add_log_info(info);
+            }
+            w.buffers.insert(w.buffers.end(), c.added.begin(), c.added.end());
+            c.added.clear();
+            if (!drain(w, c, ep))
+                break;
+            c.state.store(CHUNK_DONE, std::memory_order_release);
+        }
+        if (crash_.load(std::memory_order_acquire)) {
+            // the crash thread owns our buffers now, the process is going down
+            w.parked.store(true, std::memory_order_release);
+            while (true) {
+                pause();
+            }
+        }
+    }
+
+    // formats the records of the worker's buffers logged before the epoch's
+    // cutoff, false when a crash drain asked it to stop
+    bool drain(worker &w, chunk &c, const epoch &ep)
+    {
+        size_t info_cnt = w.handler.get_log_infos_cnt();
+        auto   ready    = [&](const staging_buffer::queue_header *h) {
+            return h && staging_buffer::log_id(h) < info_cnt && msg_tsc(h) < ep.tsc;
+        };
+        auto later = [](const heap_node &a, const heap_node &b) {
+            return a.tsc > b.tsc;
+        };
+        w.heap.clear();
+        for (size_t i = 0; i < w.buffers.size(); i++) {
+            staging_buffer *tb = w.buffers[i];
+            auto            h  = tb->front();
+            // the flag is set after the thread's last push, look at the queue
+            // again once it is seen
+            if (!h && tb->check_can_delete() && !(h = tb->front())) {
+                c.released.push_back(tb);
+                w.buffers[i] = w.buffers.back();
+                w.buffers.pop_back();
+                i--;
+                continue;
+            }
+            tb->update_high_water();
+            if (ready(h))
+                w.heap.push_back(heap_node{msg_tsc(h), tb});
+        }
+        if (ep.ordered)
+            std::make_heap(w.heap.begin(), w.heap.end(), later);
+        while (!w.heap.empty()) {
+            if (ep.ordered)
+                std::pop_heap(w.heap.begin(), w.heap.end(), later);
+            heap_node node = w.heap.back();
+            w.heap.pop_back();
+            // drain the buffer while it stays below the next smallest front
+            int64_t limit = ep.ordered && !w.heap.empty() ? w.heap.front().tsc : INT64_MAX;
+            auto    h     = node.tb->front();
+            do {
+                // between records the chunk and the buffer list are whole
+                if (crash_.load(std::memory_order_relaxed))
+                    return false;
+                format_record(w, c, node.tb->get_name(), h, ep.ordered);
+                node.tb->pop(h);
+                h = node.tb->front();
+            } while (ready(h) && msg_tsc(h) < limit);
+            node.tb->release();
+            if (ep.ordered && ready(h)) {
+                w.heap.push_back(heap_node{msg_tsc(h), node.tb});
+                std::push_heap(w.heap.begin(), w.heap.end(), later);
+            }
+        }
+        return true;
+    }
+
+    void format_record(worker &w, chunk &c, const char *name, const staging_buffer::queue_header *header, bool ordered)
+    {
+        size_t      len;
+        const char *line = w.handler.format_line(name, header, len);
+        if (!line)
+            return;
+        if (c.text_len + len > c.text_cap) {
+            c.text_cap = std::max(c.text_cap * 2, std::max(c.text_len + len, size_t(64 * 1024)));
+            c.text     = static_cast<char *>(realloc(c.text, c.text_cap));
+        }
+        memcpy(c.text + c.text_len, line, len);
+        c.text_len += len;
+        if (ordered)
+            c.lines.push_back(line_meta{msg_tsc(header), c.text_len});
+        c.line_cnt++;
+    }
+
+    // spins a little, then sleeps on the chunk state until the poller wakes
+    // us, false on stop or crash
+    bool wait_filled(worker &w, chunk &c)
+    {
+        for (int i = 0;; i++) {
+            uint32_t state = c.state.load(std::memory_order_acquire);
+            if (state == CHUNK_FILLED)
+                return true;
+            if (stop_.load(std::memory_order_acquire) || crash_.load(std::memory_order_acquire))
+                return false;
+            if (i < SPIN_CNT) {
+                details::cpu_relax();
+                continue;
+            }
+            w.waiting.store(true, std::memory_order_seq_cst);
+            if (c.state.load(std::memory_order_seq_cst) == state && !stop_.load(std::memory_order_seq_cst) && !crash_.load(std::memory_order_seq_cst)) {
+                timespec ts{0, 1000000};
+                syscall(SYS_futex, reinterpret_cast<uint32_t *>(&c.state), FUTEX_WAIT_PRIVATE, state, &ts, nullptr, 0);
+            }
+            w.waiting.store(false, std::memory_order_relaxed);
+        }
+    }
+
+  private:
+    log_handler                         &out_;
+    std::vector<std::unique_ptr<worker>> workers_;
+    epoch                                epochs_[DEPTH];
+    std::atomic<bool>                    stop_{false};
+    std::atomic<bool>                    crash_{false};
+    uint64_t                             fill_seq_{0};
+    uint64_t                             write_seq_{0};
+    // poller side, dictionary entries published so far
+    size_t                               infos_sent_{0};
+    std::vector<staging_buffer *>        released_;
+};
@@ -0,0 +1,322 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+// math.h is not included on purpose, its double_t collides with format_type
+//
+// Hand written printf conversions used by log_handler instead of sprintf.
+// Every routine writes at out and returns the end of what it wrote, the
+// floating point one returns nullptr when the caller has to fall back to
+// snprintf to stay byte-identical with printf.
+namespace details {
+
+enum format_flag : uint8_t
+{
+    FLAG_MINUS = 1,
+    FLAG_PLUS  = 2,
+    FLAG_SPACE = 4,
+    FLAG_HASH  = 8,
+    FLAG_ZERO  = 16,
+};
+
+struct format_spec
+{
+    uint8_t flags;
+    char    specifier;
+    int32_t width;     // -1 if absent
+    int32_t precision; // -1 if absent
+};
+
+// larger precisions are left to snprintf
+static constexpr int32_t MAX_FAST_PRECISION = 64;
+
+static const double pow10_double[] = {1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11, 1e12, 1e13, 1e14, 1e15, 1e16, 1e17};
+
+static const char digit_pairs[201] = "00010203040506070809"
+                                     "10111213141516171819"
+                                     "20212223242526272829"
+                                     "30313233343536373839"
+                                     "40414243444546474849"
+                                     "50515253545556575859"
+                                     "60616263646566676869"
+                                     "70717273747576777879"
+                                     "80818283848586878889"
+                                     "90919293949596979899";
+
+// writes the decimal digits of v right-aligned so that they end at end,
+// returns the first digit
+inline char *write_decimal_backward(char *end, uint64_t v)
+{
+    while (v >= 100) {
+        uint64_t q = v / 100;
+        end -= 2;
+        memcpy(end, digit_pairs + (v - q * 100) * 2, 2);
+        v = q;
+    }
+    if (v >= 10) {
+        end -= 2;
+        memcpy(end, digit_pairs + v * 2, 2);
+    } else {
+        *--end = static_cast<char>('0' + v);
+    }
+    return end;
+}
+
+// copies body with the sign/prefix and the padding required by width and
+// the '-' and '0' flags
+inline char *write_padded(char *out, const format_spec &spec, const char *prefix, size_t prefix_len, const char *body, size_t body_len,
+                          bool allow_zero_pad)
+{
+    size_t len = prefix_len + body_len;
+    size_t pad = spec.width > 0 && static_cast<size_t>(spec.width) > len ? spec.width - len : 0;
+    if (pad && !(spec.flags & FLAG_MINUS) && !(allow_zero_pad && (spec.flags & FLAG_ZERO))) {
+        memset(out, ' ', pad);
+        out += pad;
+        pad = 0;
+    }
+    memcpy(out, prefix, prefix_len);
+    out += prefix_len;
+    if (pad && !(spec.flags & FLAG_MINUS)) {
+        memset(out, '0', pad);
+        out += pad;
+        pad = 0;
+    }
+    memcpy(out, body, body_len);
+    out += body_len;
+    if (pad) {
+        memset(out, ' ', pad);
+        out += pad;
+    }
+    return out;
+}
+
+// %d %i %u %o %x %X, v is the magnitude
+inline char *format_integer(char *out, uint64_t v, bool negative, const format_spec &spec)
+{
+    char  buf[32];
+    char *end   = buf + sizeof(buf);
+    char *begin = end;
+    switch (spec.specifier) {
+        case 'x':
+        case 'X': {
+            const char *hex = spec.specifier == 'x' ? "0123456789abcdef" : "0123456789ABCDEF";
+            while (v) {
+                *--begin = hex[v & 15];
+                v >>= 4;
+            }
+            break;
+        }
+        case 'o':
+            while (v) {
+                *--begin = static_cast<char>('0' + (v & 7));
+                v >>= 3;
+            }
+            break;
+        default:
+            if (v)
+                begin = write_decimal_backward(end, v);
+            break;
+    }
+    bool   is_zero    = begin == end;
+    size_t digits     = static_cast<size_t>(end - begin);
+    size_t min_digits = spec.precision >= 0 ? spec.precision : 1;
+    char   zeros[MAX_FAST_PRECISION + 1];
+    size_t zero_cnt = 0;
+    if (digits < min_digits) {
+        zero_cnt = min_digits - digits;
+        memset(zeros, '0', zero_cnt);
+    }
+    char   prefix[3];
+    size_t prefix_len = 0;
+    if (spec.specifier == 'd' || spec.specifier == 'i') {
+        if (negative)
+            prefix[prefix_len++] = '-';
+        else if (spec.flags & FLAG_PLUS)
+            prefix[prefix_len++] = '+';
+        else if (spec.flags & FLAG_SPACE)
+            prefix[prefix_len++] = ' ';
+    } else if (spec.flags & FLAG_HASH) {
+        // '#' makes sure the octal output starts with a 0
+        if (spec.specifier == 'o' && zero_cnt == 0) {
+            zeros[zero_cnt++] = '0';
+        } else if ((spec.specifier == 'x' || spec.specifier == 'X') && !is_zero) {
+            prefix[prefix_len++] = '0';
+            prefix[prefix_len++] = spec.specifier;
+        }
+    }
+    // the body is the zero extension followed by the digits
+    char   body[sizeof(zeros) + 32];
+    size_t body_len = 0;
+    memcpy(body, zeros, zero_cnt);
+    body_len += zero_cnt;
+    memcpy(body + body_len, begin, digits);
+    body_len += digits;
+    return write_padded(out, spec, prefix, prefix_len, body, body_len, spec.precision < 0);
+}
+
+template <typename T>
+inline char *format_signed(char *out, T v, const format_spec &spec)
+{
+    uint64_t magnitude = v < 0 ? 0 - static_cast<uint64_t>(v) : static_cast<uint64_t>(v);
+    return format_integer(out, magnitude, v < 0, spec);
+}
+
+// %f %F; nullptr for values, precisions or rounding ties we can not render
+// exactly like printf. With exact false ties are rounded up instead.
+inline char *format_fixed(char *out, double v, const format_spec &spec, bool exact = true)
+{
+    static const uint64_t upow10[] = {1ULL,
+                                      10ULL,
+                                      100ULL,
+                                      1000ULL,
+                                      10000ULL,
+                                      100000ULL,
+                                      1000000ULL,
+                                      10000000ULL,
+                                      100000000ULL,
+                                      1000000000ULL,
+                                      10000000000ULL,
+                                      100000000000ULL,
+                                      1000000000000ULL,
+                                      10000000000000ULL,
+                                      100000000000000ULL,
+                                      1000000000000000ULL,
+                                      10000000000000000ULL,
+                                      100000000000000000ULL};
+    int precision = spec.precision < 0 ? 6 : spec.precision;
+    if (!__builtin_isfinite(v) || precision > 17)
+        return nullptr;
+    bool   negative = __builtin_signbit(v);
+    double scaled   = __builtin_fabs(v) * pow10_double[precision];
+    if (scaled >= 9007199254740992.0) // 2^53
+        return nullptr;
+    // the multiplication rounds once, so the nearest integer is the one
+    // printf picks unless we are within that rounding error of a tie
+    double floor_scaled = __builtin_floor(scaled);
+    double frac         = scaled - floor_scaled;
+    if (exact && __builtin_fabs(frac - 0.5) <= scaled * 4.5e-16)
+        return nullptr;
+    uint64_t n = static_cast<uint64_t>(floor_scaled) + (frac > 0.5 ? 1 : 0);
+
+    char  buf[48];
+    char *end   = buf + sizeof(buf);
+    char *begin = end;
+    if (precision) {
+        uint64_t frac_part = n % upow10[precision];
+        n /= upow10[precision];
+        char *frac_begin = frac_part ? write_decimal_backward(end, frac_part) : end;
+        while (end - frac_begin < precision)
+            *--frac_begin = '0';
+        begin    = frac_begin;
+        *--begin = '.';
+    } else if (spec.flags & FLAG_HASH) {
+        *--begin = '.';
+    }
+    begin = write_decimal_backward(begin, n);
+
+    char   prefix[1];
+    size_t prefix_len = 0;
+    if (negative)
+        prefix[prefix_len++] = '-';
+    else if (spec.flags & FLAG_PLUS)
+        prefix[prefix_len++] = '+';
+    else if (spec.flags & FLAG_SPACE)
+        prefix[prefix_len++] = ' ';
+    return write_padded(out, spec, prefix, prefix_len, begin, end - begin, true);
+}
+
+// any floating point conversion without snprintf, for the signal safe path.
+// %f is exact apart from ties, everything else is printed as %e and the last
+// digits may differ from printf.
+inline char *format_double_approx(char *out, double v, const format_spec &spec)
+{
+    bool   upper = spec.specifier >= 'A' && spec.specifier <= 'Z';
+    char   prefix[1];
+    size_t prefix_len = 0;
+    if (__builtin_signbit(v))
+        prefix[prefix_len++] = '-';
+    else if (spec.flags & FLAG_PLUS)
+        prefix[prefix_len++] = '+';
+    else if (spec.flags & FLAG_SPACE)
+        prefix[prefix_len++] = ' ';
+    if (!__builtin_isfinite(v)) {
+        const char *body = __builtin_isnan(v) ? (upper ? "NAN" : "nan") : (upper ? "INF" : "inf");
+        return write_padded(out, spec, prefix, prefix_len, body, 3, false);
+    }
+    format_spec s = spec;
+    if (s.precision > 17)
+        s.precision = 17;
+    if (spec.specifier == 'f' || spec.specifier == 'F') {
+        char *end = format_fixed(out, v, s, false);
+        if (end)
+            return end;
+    }
+    double a     = __builtin_fabs(v);
+    int    exp10 = 0;
+    if (a != 0) {
+        while (a >= 10) {
+            a /= 10;
+            exp10++;
+        }
+        while (a < 1) {
+            a *= 10;
+            exp10--;
+        }
+    }
+    int      precision = s.precision < 0 ? 6 : s.precision;
+    uint64_t digits    = static_cast<uint64_t>(a * pow10_double[precision] + 0.5);
+    if (digits >= static_cast<uint64_t>(10 * pow10_double[precision])) {
+        digits /= 10;
+        exp10++;
+    }
+    // d.ddd followed by e+XX
+    char  buf[40];
+    char *end   = buf + sizeof(buf);
+    char *begin = write_decimal_backward(end, static_cast<uint64_t>(exp10 < 0 ? -exp10 : exp10));
+    if (end - begin < 2)
+        *--begin = '0';
+    *--begin = exp10 < 0 ? '-' : '+';
+    *--begin = upper ? 'E' : 'e';
+    char *mantissa_end = begin;
+    begin              = write_decimal_backward(begin, digits);
+    while (mantissa_end - begin < precision + 1)
+        *--begin = '0';
+    if (precision || (spec.flags & FLAG_HASH)) {
+        memmove(begin - 1, begin, 1);
+        begin[0] = '.';
+        begin--;
+    }
+    return write_padded(out, spec, prefix, prefix_len, begin, end - begin, true);
+}
+
+// %s, len is the length of the argument, precision truncates it
+inline char *format_string(char *out, const char *str, size_t len, const format_spec &spec)
+{
+    if (spec.precision >= 0 && static_cast<size_t>(spec.precision) < len)
+        len = spec.precision;
+    if (spec.width <= 0) {
+        memcpy(out, str, len);
+        return out + len;
+    }
+    return write_padded(out, spec, nullptr, 0, str, len, false);
+}
+
+// %c
+inline char *format_char(char *out, char c, const format_spec &spec)
+{
+    return write_padded(out, spec, nullptr, 0, &c, 1, false);
+}
+
+// %p, glibc style
+inline char *format_pointer(char *out, const void *ptr, const format_spec &spec)
+{
+    if (!ptr)
+        return write_padded(out, spec, nullptr, 0, "(nil)", 5, false);
+    format_spec hex = spec;
+    hex.specifier   = 'x';
+    hex.flags |= FLAG_HASH;
+    return format_integer(out, reinterpret_cast<uintptr_t>(ptr), false, hex);
+}
+
+} // namespace details
@@ -1,15 +1,54 @@
 #pragma once
+#include "binary_log.h"
 #include "file_appender.h"
+#include "log_sink.h"
 #include "staging_buffer.h"
 #include "static_log_info.h"
 #include "tscns.h"
+#include <algorithm>
+#include <errno.h>
 #include <iostream>
+#include <time.h>
+#include <type_traits>
+#include <unistd.h>
 #include <vector>
 
+enum time_precision : uint8_t
+{
+    // "HH:MM:SS mmm"
+    TIME_MS = 0,
+    // "HH:MM:SS mmm.uuu"
+    TIME_US = 1,
+    // "HH:MM:SS mmm.uuu.nnn"
+    TIME_NS = 2,
+};
+
+// the date and time of the last second formatted, handlers polled under the
+// same lock can share one, see stra_logger_group
+struct time_cache
+{
+    char    buf[64];
+    time_t  last_second{-1};
+    bool    utc{false};
+    // local day whose date is in buf
+    int64_t day{INT64_MIN};
+    // utc_offset holds for seconds in [offset_from, offset_until)
+    long    utc_offset{0};
+    time_t  offset_from{0};
+    time_t  offset_until{0};
+};
+
 class log_handler
 {
   public:
-    log_handler(TSCNS &tscns) : tscns_(tscns)
+    static constexpr size_t OUTPUT_BUF_SIZE = 1024 * 1024;
+    // records above this size may not format into OUTPUT_BUF_SIZE, their
+    // line is sized first
+    static constexpr size_t LARGE_RECORD_BYTES = OUTPUT_BUF_SIZE / 4;
+
+    // with own_log_infos false the fragments belong to another handler, e.g.
+    // the handlers of the format_pipeline workers
+    log_handler(TSCNS &tscns, bool own_log_infos = true) : tscns_(tscns), output_buf_(new char[OUTPUT_BUF_SIZE]), own_log_infos_(own_log_infos)
     {
     }
     ~log_handler()
@@ -18,9 +57,11 @@ class log_handler
             file_->flush();
             delete file_;
         }
+        delete[] output_buf_;
+        free(large_buf_);
         for (auto info : bg_log_infos_) {
-            if (info.fragments) {
-                delete info.fragments;
+            if (own_log_infos_ && info.fragments) {
+                free(info.fragments);
             }
         }
     }
@@ -30,146 +71,710 @@ class log_handler
             return;
         file_ = new file_appender(filename);
     }
+    // takes ownership of sink, e.g. a batch_file_appender
+    void set_log_sink(log_sink *sink)
+    {
+        if (file_ != nullptr) {
+            delete sink;
+            return;
+        }
+        file_ = sink;
+    }
+    // write raw records plus the format dictionary instead of text, see
+    // binary_log.h and fast_logger_decompress
+    void set_binary_log_file(const char *filename)
+    {
+        if (file_ != nullptr)
+            return;
+        set_binary_log_sink(new file_appender(filename));
+    }
+    void set_binary_log_sink(log_sink *sink)
+    {
+        if (file_ != nullptr) {
+            delete sink;
+            return;
+        }
+        file_   = sink;
+        binary_ = true;
+        binary_log::file_header fh{};
+        memcpy(fh.magic, binary_log::MAGIC, sizeof(fh.magic));
+        fh.version = binary_log::VERSION;
+        file_->append(reinterpret_cast<const char *>(&fh), sizeof(fh));
+        for (size_t i = 0; i < bg_log_infos_.size(); i++) {
+            write_binary_log_info(i, bg_log_infos_[i]);
+        }
+    }
+    void flush()
+    {
+        if (file_) {
+            file_->flush();
+        } else if (!signal_safe_) {
+            fflush(stdout);
+        }
+    }
+    // from now on only async-signal-safe calls are made, used to drain the
+    // staging buffers from a signal handler. There is no way back.
+    void set_signal_safe()
+    {
+        signal_safe_ = true;
+        if (file_) {
+            file_->enter_crash_mode();
+        }
+    }
     size_t get_log_infos_cnt()
     {
         return bg_log_infos_.size();
     }
+    const static_log_info &get_log_info(size_t log_id) const
+    {
+        return bg_log_infos_[log_id];
+    }
+    bool is_binary() const
+    {
+        return binary_;
+    }
+    // nullptr goes back to the handler's own cache
+    void share_time_cache(time_cache *cache)
+    {
+        time_ = cache ? cache : &own_time_;
+    }
+    // sub-second digits and time zone of the line prefix, local time with
+    // TIME_US by default
+    void set_time_format(time_precision precision, bool utc)
+    {
+        precision_ = precision;
+        utc_       = utc;
+    }
+    time_precision get_time_precision() const
+    {
+        return precision_;
+    }
+    bool is_utc() const
+    {
+        return utc_;
+    }
+    // add_log_info calls that fit without allocating, the crash drain only
+    // merges that many
+    size_t log_infos_room() const
+    {
+        return bg_log_infos_.capacity() - bg_log_infos_.size();
+    }
+    void reserve_log_infos(size_t room)
+    {
+        if (log_infos_room() < room)
+            bg_log_infos_.reserve(std::max(bg_log_infos_.size() * 2, bg_log_infos_.size() + room));
+    }
     void add_log_info(static_log_info info)
     {
         bg_log_infos_.push_back(info);
+        if (binary_) {
+            write_binary_log_info(bg_log_infos_.size() - 1, info);
+        }
     }
-    template <typename T>
-    int handle_single_arg(char *output, const char *formatString, T arg, uint32_t data_size)
+    // text lines go to sink instead of the handler's own when given
+    void handle_log(const char *name, const staging_buffer::queue_header *header, log_sink *sink = nullptr)
     {
-        if (data_size != sizeof(T)) {
-            return sprintf(output, " [error arg] ");
+        if (binary_) {
+            write_binary_log(name, header);
+            return;
         }
-        return sprintf(output, formatString, arg);
+        size_t      len;
+        const char *line = format_line(name, header, len, sink);
+        if (line)
+            write_output(line, len, sink);
     }
-    void handle_log(const char *name, const staging_buffer::queue_header *header)
+
+    // formats the text line of a record into the handler's own buffer, which
+    // stays valid until the next call. nullptr when a placeholder went to
+    // sink instead, see large_line_buf.
+    const char *format_line(const char *name, const staging_buffer::queue_header *header, size_t &len, log_sink *sink = nullptr)
     {
-        char             output_buf[1024 * 1024];
-        static_log_info &info = bg_log_infos_[header->userdata];
+        char *buf = output_buf_;
+        if (header->size > LARGE_RECORD_BYTES) {
+            buf = large_line_buf(name, header, sink);
+            if (!buf)
+                return nullptr;
+        }
+        len = format_log(buf, name, header);
+        return buf;
+    }
+
+    // formats the text line of a record into output_buf, which has room for
+    // OUTPUT_BUF_SIZE bytes, and returns its length
+    size_t format_log(char *output_buf, const char *name, const staging_buffer::queue_header *header)
+    {
+        static_log_info &info    = bg_log_infos_[staging_buffer::log_id(header)];
+        bool             compact = header->userdata & staging_buffer::COMPACT_RECORD;
         header++;
         uint64_t timestamp = *(uint64_t *)(header);
         header++;
-        char              *argData           = (char *)header;
-        static const char *log_level_names[] = {"TRACE", "DEBUG", "INFO", "WARN", "ERROR", "FATAL"};
-        const char        *log_level         = log_level_names[info.lelvel];
-        uint64_t           ns                = tscns_.tsc2ns(timestamp);
-        time_t             seconds           = static_cast<time_t>(ns / (1000000000));
-        int                muns              = static_cast<int>(ns % (1000000000));
-        int                ms                = muns / 1000000;
-        int                us                = (muns % 1000000) / 1000;
-        if (seconds != last_second_) {
-            last_second_ = seconds;
-            struct tm tm_time;
-            {
-                ::localtime_r(&seconds, &tm_time);
+        arg_reader            args{(const char *)header, info.arg_sizes, info.arg_sizes + info.args_num, compact};
+        char                 *output = output_buf + format_prefix(output_buf, name, tscns_.tsc2ns(timestamp), info.lelvel);
+        const print_fragment *pf     = reinterpret_cast<const print_fragment *>(info.fragments);
+        for (int i = 0; i < info.num_print_fragments; ++i, pf = pf->next()) {
+            memcpy(output, pf->literal(), pf->literal_length);
+            output += pf->literal_length;
+            if (pf->arg_type != NONE) {
+                details::format_spec spec = pf->spec;
+                if (pf->has_dynamic_width) {
+                    int width = read_int_arg(args);
+                    if (width < 0) {
+                        spec.flags |= details::FLAG_MINUS;
+                        width = -width;
+                    }
+                    spec.width = width;
+                }
+                if (pf->has_dynamic_precision) {
+                    int precision  = read_int_arg(args);
+                    spec.precision = precision < 0 ? -1 : precision;
+                }
+                output = format_arg(output, pf, spec, args);
             }
-            snprintf(time_buf_, sizeof(time_buf_), "%04d-%02d-%02d %02d:%02d:%02d", tm_time.tm_year + 1900, tm_time.tm_mon + 1, tm_time.tm_mday,
-                     tm_time.tm_hour, tm_time.tm_min, tm_time.tm_sec);
-        }
-        char *output  = output_buf;
-        int   log_len = 0;
-        log_len += sprintf(output, "[%s] [%s %03d.%03d] [%s] ", name, time_buf_, ms, us, log_level);
-        output             = output_buf + log_len;
-        print_fragment *pf = reinterpret_cast<print_fragment *>(info.fragments);
-        for (int i = 0; i < info.num_print_fragments; ++i) {
-            uint32_t data_size = *(uint32_t *)(argData);
-            argData += sizeof(uint32_t);
-            switch (pf->arg_type) {
-                case NONE:
+            memcpy(output, pf->suffix(), pf->suffix_length);
+            output += pf->suffix_length;
+        }
+        *output++ = '\n';
+        return output - output_buf;
+    }
+
+    // formatted text to sink, the handler's own sink or stdout
+    void write_output(const char *data, size_t len, log_sink *sink = nullptr)
+    {
+        if (sink) {
+            sink->append(data, len);
+        } else if (file_) {
+            file_->append(data, len);
+        } else if (signal_safe_) {
+            write_stdout(data, len);
+        } else {
+            fwrite(data, 1, len, stdout);
+        }
+    }
+
+    // a line that did not go through a staging buffer, e.g. the logger's own
+    // statistics
+    void write_text_log(const char *name, log_level level, int64_t ns, const char *msg, size_t len)
+    {
+        if (binary_) {
+            binary_log::text_entry entry;
+            entry.ns    = ns;
+            entry.level = level;
+            entry.len   = static_cast<uint32_t>(len);
+            char type   = binary_log::ENTRY_TEXT;
+            write_binary_thread_name(name);
+            file_->append(&type, 1);
+            file_->append(reinterpret_cast<const char *>(&entry), sizeof(entry));
+            file_->append(msg, len);
+            return;
+        }
+        char prefix[128];
+        int  prefix_len = format_prefix(prefix, name, ns, level);
+        if (file_) {
+            file_->append(prefix, prefix_len);
+            file_->append(msg, len);
+            file_->append("\n", 1);
+        } else if (signal_safe_) {
+            write_stdout(prefix, prefix_len);
+            write_stdout(msg, len);
+            write_stdout("\n", 1);
+        } else {
+            fprintf(stdout, "%s%.*s\n", prefix, static_cast<int>(len), msg);
+        }
+    }
+
+  private:
+    static void write_stdout(const char *data, size_t len)
+    {
+        while (len > 0) {
+            ssize_t n = ::write(STDOUT_FILENO, data, len);
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n <= 0)
+                return;
+            data += n;
+            len -= n;
+        }
+    }
+
+    // a buffer large enough for the line of a record above
+    // LARGE_RECORD_BYTES, nullptr when it was written as a placeholder
+    char *large_line_buf(const char *name, const staging_buffer::queue_header *header, log_sink *sink)
+    {
+        const static_log_info &info = bg_log_infos_[staging_buffer::log_id(header)];
+        size_t                 need = header->size + strlen(info.fmt_str) + 512 * info.args_num + 256;
+        if (need <= OUTPUT_BUF_SIZE)
+            return output_buf_;
+        if (need > large_buf_size_) {
+            if (signal_safe_) {
+                // no allocation here, keep the line but not its arguments
+                details::format_spec spec{0, 'u', -1, -1};
+                char                 msg[64];
+                char                *p = msg;
+                memcpy(p, "[record of ", 11);
+                p += 11;
+                p = details::format_integer(p, header->size, false, spec);
+                memcpy(p, " bytes skipped]", 15);
+                p += 15;
+                size_t len = format_prefix(output_buf_, name, tscns_.tsc2ns(*(const uint64_t *)(header + 1)), info.lelvel);
+                memcpy(output_buf_ + len, msg, p - msg);
+                len += p - msg;
+                output_buf_[len++] = '\n';
+                write_output(output_buf_, len, sink);
+                return nullptr;
+            }
+            free(large_buf_);
+            large_buf_      = static_cast<char *>(malloc(need));
+            large_buf_size_ = need;
+        }
+        return large_buf_;
+    }
+
+    // walks the arguments of a record, see details::arg_layout
+    struct arg_reader
+    {
+        const char    *data;
+        const uint8_t *size;
+        const uint8_t *end;
+        // integers and string lengths are varints, see staging_buffer::write_compact
+        bool           compact;
+        // the current argument, a varint is decoded into value
+        const char    *arg{nullptr};
+        uint64_t       value{0};
+
+        // false once the record has no arguments left, otherwise arg points
+        // at the next one, len is its size and string whether it is one
+        bool next(uint32_t &len, bool &string)
+        {
+            if (size == end)
+                return false;
+            uint8_t kind = *size++;
+            len          = kind & details::ARG_SIZE_MASK;
+            string       = len == 0;
+            if (compact && (string || (kind & details::ARG_VARINT))) {
+                value = details::read_varint(data);
+                if (kind & details::ARG_SIGNED)
+                    value = static_cast<uint64_t>(details::unzigzag(value));
+                if (!string) {
+                    // little endian, the low len bytes are the argument
+                    arg = reinterpret_cast<const char *>(&value);
+                    return true;
+                }
+                len = static_cast<uint32_t>(value);
+            } else if (string) {
+                memcpy(&len, data, sizeof(uint32_t));
+                data += sizeof(uint32_t);
+            }
+            arg = data;
+            data += len;
+            return true;
+        }
+    };
+
+    int read_int_arg(arg_reader &args)
+    {
+        uint32_t len;
+        bool     string;
+        if (!args.next(len, string))
+            return 0;
+        return !string && len == sizeof(int) ? *(const int *)args.arg : 0;
+    }
+
+    // conversions the hand written formatters do not cover. The conversion
+    // text saved at registration is passed to sprintf as is, only a dynamic
+    // width/precision makes us rebuild it with the values resolved.
+    template <typename T>
+    char *format_fallback(char *output, const print_fragment *pf, const details::format_spec &spec, T arg)
+    {
+        if (signal_safe_)
+            return format_signal_safe(output, spec, arg);
+        char  fmt[48];
+        char *p = fmt;
+        if (!pf->has_dynamic_width && !pf->has_dynamic_precision && pf->spec_length && pf->spec_length < sizeof(fmt)) {
+            memcpy(fmt, pf->format_fragment + pf->spec_offset, pf->spec_length);
+            fmt[pf->spec_length] = '\0';
 #pragma GCC diagnostic push
-#pragma GCC diagnostic ignored "-Wformat-security"
 #pragma GCC diagnostic ignored "-Wformat-nonliteral"
-                    log_len += sprintf(output, pf->format_fragment);
+            return output + sprintf(output, fmt, arg);
 #pragma GCC diagnostic pop
-                    break;
-
-                case unsigned_char_t:
-                    log_len += handle_single_arg(output, pf->format_fragment, *(unsigned char *)argData, data_size);
-                    break;
-                case unsigned_short_int_t:
-                    log_len += handle_single_arg(output, pf->format_fragment, *(unsigned short int *)argData, data_size);
-                    break;
-                case unsigned_int_t:
-                    log_len += handle_single_arg(output, pf->format_fragment, *(unsigned int *)argData, data_size);
-                    break;
-                case unsigned_long_int_t:
-                    log_len += handle_single_arg(output, pf->format_fragment, *(unsigned long int *)argData, data_size);
-                    break;
-                case unsigned_long_long_int_t:
-                    log_len += handle_single_arg(output, pf->format_fragment, *(unsigned long long int *)argData, data_size);
-                    break;
-                case uintmax_t_t:
-                    log_len += handle_single_arg(output, pf->format_fragment, *(uintmax_t *)argData, data_size);
-                    break;
-                case size_t_t:
-                    log_len += handle_single_arg(output, pf->format_fragment, *(size_t *)argData, data_size);
-                    break;
-                case wint_t_t:
-                    log_len += handle_single_arg(output, pf->format_fragment, *(wint_t *)argData, data_size);
-                    break;
-                case signed_char_t:
-                    log_len += handle_single_arg(output, pf->format_fragment, *(signed char *)argData, data_size);
-                    break;
-                case short_int_t:
-                    log_len += handle_single_arg(output, pf->format_fragment, *(short int *)argData, data_size);
-                    break;
-                case int_t: {
-                    log_len += handle_single_arg(output, pf->format_fragment, *(int *)argData, data_size);
-                    break;
+        }
+        *p++ = '%';
+        if (spec.flags & details::FLAG_MINUS)
+            *p++ = '-';
+        if (spec.flags & details::FLAG_PLUS)
+            *p++ = '+';
+        if (spec.flags & details::FLAG_SPACE)
+            *p++ = ' ';
+        if (spec.flags & details::FLAG_HASH)
+            *p++ = '#';
+        if (spec.flags & details::FLAG_ZERO)
+            *p++ = '0';
+        if (spec.width >= 0)
+            p += sprintf(p, "%d", spec.width);
+        if (spec.precision >= 0)
+            p += sprintf(p, ".%d", spec.precision);
+        for (const char *l = pf->length; *l; l++)
+            *p++ = *l;
+        *p++ = spec.specifier;
+        *p   = '\0';
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wformat-nonliteral"
+        return output + sprintf(output, fmt, arg);
+#pragma GCC diagnostic pop
+    }
+
+    // snprintf is not async-signal-safe, approximate what it would print
+    template <typename T>
+    typename std::enable_if<std::is_floating_point<T>::value, char *>::type format_signal_safe(char *output, const details::format_spec &spec, T arg)
+    {
+        return details::format_double_approx(output, static_cast<double>(arg), spec);
+    }
+
+    template <typename T>
+    typename std::enable_if<std::is_integral<T>::value, char *>::type format_signal_safe(char *output, const details::format_spec &spec, T arg)
+    {
+        if (spec.specifier == 'c')
+            return details::format_char(output, static_cast<char>(arg), spec);
+        details::format_spec s = spec;
+        if (s.precision > details::MAX_FAST_PRECISION)
+            s.precision = details::MAX_FAST_PRECISION;
+        if (s.specifier == 'd' || s.specifier == 'i')
+            return details::format_signed(output, static_cast<int64_t>(arg), s);
+        return details::format_integer(output, static_cast<uint64_t>(arg), false, s);
+    }
+
+    template <typename T>
+    char *format_int_arg(char *output, const print_fragment *pf, const details::format_spec &spec, T arg)
+    {
+        if (spec.precision > details::MAX_FAST_PRECISION)
+            return format_fallback(output, pf, spec, arg);
+        switch (spec.specifier) {
+            case 'd':
+            case 'i':
+                return details::format_signed(output, static_cast<typename std::make_signed<T>::type>(arg), spec);
+            case 'c':
+                return details::format_char(output, static_cast<char>(arg), spec);
+            default:
+                return details::format_integer(output, static_cast<typename std::make_unsigned<T>::type>(arg), false, spec);
+        }
+    }
+
+    char *format_double_arg(char *output, const print_fragment *pf, const details::format_spec &spec, double arg)
+    {
+        if (spec.specifier == 'f' || spec.specifier == 'F') {
+            char *end = details::format_fixed(output, arg, spec);
+            if (end)
+                return end;
+        }
+        return format_fallback(output, pf, spec, arg);
+    }
+
+    static char *write_arg_error(char *output)
+    {
+        static const char error[] = " [error arg] ";
+        memcpy(output, error, sizeof(error) - 1);
+        return output + sizeof(error) - 1;
+    }
+
+    template <typename T>
+    bool check_arg_size(char *&output, uint32_t data_size, bool string)
+    {
+        if (!string && data_size == sizeof(T))
+            return true;
+        output = write_arg_error(output);
+        return false;
+    }
+
+    // formats one argument and advances the reader past it
+    char *format_arg(char *output, const print_fragment *pf, const details::format_spec &spec, arg_reader &args)
+    {
+        uint32_t data_size;
+        bool     string;
+        if (!args.next(data_size, string))
+            return write_arg_error(output);
+        const char *data = args.arg;
+
+#define FAST_LOG_INT_ARG(type)                                                                                                                       \
+    if (check_arg_size<type>(output, data_size, string)) {                                                                                           \
+        output = format_int_arg(output, pf, spec, *(const type *)data);                                                                             \
+    }                                                                                                                                                \
+    break
+
+// stored promoted to int, see details::promoted_arg
+#define FAST_LOG_NARROW_INT_ARG(type)                                                                                                                \
+    if (check_arg_size<int>(output, data_size, string)) {                                                                                            \
+        output = format_int_arg(output, pf, spec, static_cast<type>(*(const int *)data));                                                           \
+    }                                                                                                                                                \
+    break
+
+        switch (pf->arg_type) {
+            case unsigned_char_t:
+                FAST_LOG_NARROW_INT_ARG(unsigned char);
+            case unsigned_short_int_t:
+                FAST_LOG_NARROW_INT_ARG(unsigned short int);
+            case unsigned_int_t:
+                FAST_LOG_INT_ARG(unsigned int);
+            case unsigned_long_int_t:
+                FAST_LOG_INT_ARG(unsigned long int);
+            case unsigned_long_long_int_t:
+                FAST_LOG_INT_ARG(unsigned long long int);
+            case uintmax_t_t:
+                FAST_LOG_INT_ARG(uintmax_t);
+            case size_t_t:
+                FAST_LOG_INT_ARG(size_t);
+            case signed_char_t:
+                FAST_LOG_NARROW_INT_ARG(signed char);
+            case short_int_t:
+                FAST_LOG_NARROW_INT_ARG(short int);
+            case int_t:
+                FAST_LOG_INT_ARG(int);
+            case long_int_t:
+                FAST_LOG_INT_ARG(long int);
+            case long_long_int_t:
+                FAST_LOG_INT_ARG(long long int);
+            case intmax_t_t:
+                FAST_LOG_INT_ARG(intmax_t);
+            case ptrdiff_t_t:
+                FAST_LOG_INT_ARG(ptrdiff_t);
+            case wint_t_t:
+                if (check_arg_size<wint_t>(output, data_size, string)) {
+                    output = format_fallback(output, pf, spec, *(const wint_t *)data);
+                }
+                break;
+            case double_t:
+                if (check_arg_size<double>(output, data_size, string)) {
+                    output = format_double_arg(output, pf, spec, *(const double *)data);
+                }
+                break;
+            case long_double_t:
+                if (check_arg_size<long double>(output, data_size, string)) {
+                    output = format_fallback(output, pf, spec, *(const long double *)data);
+                }
+                break;
+            case const_void_ptr_t:
+                if (check_arg_size<const void *>(output, data_size, string)) {
+                    output = details::format_pointer(output, *(const void **)data, spec);
+                }
+                break;
+            case const_char_ptr_t:
+                if (string) {
+                    output = details::format_string(output, data, data_size, spec);
+                } else {
+                    output = write_arg_error(output);
                 }
-                case long_int_t:
-                    log_len += handle_single_arg(output, pf->format_fragment, *(long int *)argData, data_size);
-                    break;
-                case long_long_int_t:
-                    log_len += handle_single_arg(output, pf->format_fragment, *(long long int *)argData, data_size);
-                    break;
-                case intmax_t_t:
-                    log_len += handle_single_arg(output, pf->format_fragment, *(intmax_t *)argData, data_size);
-                    break;
-                case ptrdiff_t_t:
-                    log_len += handle_single_arg(output, pf->format_fragment, *(ptrdiff_t *)argData, data_size);
-                    break;
-                case double_t:
-                    log_len += handle_single_arg(output, pf->format_fragment, *(double *)argData, data_size);
-                    break;
-                case long_double_t:
-                    log_len += handle_single_arg(output, pf->format_fragment, *(long double *)argData, data_size);
-                    break;
-                case const_void_ptr_t:
-                    log_len += handle_single_arg(output, pf->format_fragment, *(const void **)argData, data_size);
-                    break;
-                case const_char_ptr_t: {
-                    char buf[data_size + 1];
-                    memcpy(buf, argData, data_size);
-                    buf[data_size] = '\0';
-                    log_len += sprintf(output, pf->format_fragment, buf);
-                    break;
+                break;
+            case MAX_FORMAT_TYPE:
+            default:
+                output += sprintf(output, "Error: Corrupt log header in header file\r\n");
+                exit(-1);
+        }
+#undef FAST_LOG_INT_ARG
+#undef FAST_LOG_NARROW_INT_ARG
+        return output;
+    }
+
+    // no sprintf, and localtime_r only when the UTC offset may have changed,
+    // see update_utc_offset
+    int format_prefix(char *output, const char *name, int64_t ns, log_level level)
+    {
+        // "] [LEVEL] " with the closing bracket of the time
+        static const char  *level_tags[]     = {"] [TRACE] ", "] [DEBUG] ", "] [INFO] ", "] [WARN] ", "] [ERROR] ", "] [FATAL] "};
+        static const size_t level_tag_lens[] = {10, 10, 9, 9, 10, 10};
+        time_t              seconds          = static_cast<time_t>(ns / (1000000000));
+        int                 subsec           = static_cast<int>(ns % (1000000000));
+        if (seconds != time_->last_second || time_->utc != utc_) {
+            update_time_buf(seconds);
+        }
+        char  *p        = output;
+        size_t name_len = strlen(name);
+        *p++            = '[';
+        memcpy(p, name, name_len);
+        p += name_len;
+        memcpy(p, "] [", 3);
+        p += 3;
+        memcpy(p, time_->buf, TIME_BUF_LEN);
+        p += TIME_BUF_LEN;
+        *p++ = ' ';
+        p    = write_3digits(p, subsec / 1000000);
+        if (precision_ >= TIME_US) {
+            *p++ = '.';
+            p    = write_3digits(p, subsec / 1000 % 1000);
+        }
+        if (precision_ == TIME_NS) {
+            *p++ = '.';
+            p    = write_3digits(p, subsec % 1000);
+        }
+        memcpy(p, level_tags[level], level_tag_lens[level]);
+        p += level_tag_lens[level];
+        *p = '\0';
+        return static_cast<int>(p - output);
+    }
+
+    static char *write_2digits(char *p, int v)
+    {
+        memcpy(p, details::digit_pairs + v * 2, 2);
+        return p + 2;
+    }
+
+    static char *write_3digits(char *p, int v)
+    {
+        *p++ = static_cast<char>('0' + v / 100);
+        return write_2digits(p, v % 100);
+    }
+
+    // "YYYY-mm-dd HH:MM:SS", the date part is only rewritten when the day
+    // changes, the time digits are patched in place
+    void update_time_buf(time_t seconds)
+    {
+        time_->last_second = seconds;
+        int64_t t          = static_cast<int64_t>(seconds);
+        if (time_->utc != utc_) {
+            time_->utc = utc_;
+            time_->day = INT64_MIN;
+        }
+        if (!utc_) {
+            if (seconds < time_->offset_from || seconds >= time_->offset_until)
+                update_utc_offset(seconds);
+            t += time_->utc_offset;
+        }
+        int64_t days = t / 86400;
+        int64_t rem  = t % 86400;
+        if (rem < 0) {
+            rem += 86400;
+            days--;
+        }
+        if (days != time_->day) {
+            time_->day = days;
+            write_date(time_->buf, days);
+        }
+        char *p = time_->buf + 11;
+        p       = write_2digits(p, static_cast<int>(rem / 3600));
+        *p++    = ':';
+        p       = write_2digits(p, static_cast<int>(rem % 3600 / 60));
+        *p++    = ':';
+        p       = write_2digits(p, static_cast<int>(rem % 60));
+        *p      = '\0';
+    }
+
+    // "YYYY-mm-dd " of a day since the epoch
+    static void write_date(char *p, int64_t days)
+    {
+        // civil_from_days, http://howardhinnant.github.io/date_algorithms.html
+        days += 719468;
+        int64_t  era  = (days >= 0 ? days : days - 146096) / 146097;
+        uint32_t doe  = static_cast<uint32_t>(days - era * 146097);
+        uint32_t yoe  = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+        uint32_t doy  = doe - (365 * yoe + yoe / 4 - yoe / 100);
+        uint32_t mp   = (5 * doy + 2) / 153;
+        int      mday = static_cast<int>(doy - (153 * mp + 2) / 5 + 1);
+        int      mon  = static_cast<int>(mp < 10 ? mp + 3 : mp - 9);
+        int      year = static_cast<int>(yoe + era * 400 + (mon <= 2));
+        p             = write_2digits(p, year / 100 % 100);
+        p             = write_2digits(p, year % 100);
+        *p++          = '-';
+        p             = write_2digits(p, mon);
+        *p++          = '-';
+        p             = write_2digits(p, mday);
+        *p            = ' ';
+    }
+
+    // Looks up the offset of seconds and how long it holds: a day ahead, or
+    // up to the DST change found by bisection within that day. That is one
+    // localtime_r per day plus ~17 around a change. localtime_r may take a
+    // lock, in signal safe mode the last offset is kept.
+    void update_utc_offset(time_t seconds)
+    {
+        if (signal_safe_)
+            return;
+        long   offset = gmt_offset(seconds);
+        time_t until  = seconds + 86400;
+        if (gmt_offset(until) != offset) {
+            time_t lo = seconds;
+            while (until - lo > 1) {
+                time_t mid = lo + (until - lo) / 2;
+                if (gmt_offset(mid) == offset) {
+                    lo = mid;
+                } else {
+                    until = mid;
                 }
-                case MAX_FORMAT_TYPE:
-                default:
-                    log_len += sprintf(output, "Error: Corrupt log header in header file\r\n");
-                    exit(-1);
             }
-            output = output_buf + log_len;
-            argData += data_size;
-            pf = reinterpret_cast<print_fragment *>(reinterpret_cast<char *>(pf) + pf->fragment_length + sizeof(print_fragment));
         }
-        if (file_) {
-            sprintf(output, "\n");
-            file_->append(output_buf, log_len + 1);
-        } else {
-            fprintf(stdout, "%s\n", output_buf);
+        time_->utc_offset   = offset;
+        time_->offset_from  = seconds;
+        time_->offset_until = until;
+    }
+
+    static long gmt_offset(time_t seconds)
+    {
+        struct tm tm_time;
+        ::localtime_r(&seconds, &tm_time);
+        return tm_time.tm_gmtoff;
+    }
+
+    void write_binary_log_info(size_t log_id, const static_log_info &info)
+    {
+        binary_log::log_info_entry entry;
+        entry.log_id   = static_cast<uint32_t>(log_id);
+        entry.line_num = info.line_num;
+        entry.level    = info.lelvel;
+        entry.args_num = info.args_num;
+        entry.fmt_len  = static_cast<uint32_t>(strlen(info.fmt_str));
+        char type      = binary_log::ENTRY_LOG_INFO;
+        file_->append(&type, 1);
+        file_->append(reinterpret_cast<const char *>(&entry), sizeof(entry));
+        file_->append(info.fmt_str, entry.fmt_len);
+        file_->append(reinterpret_cast<const char *>(info.arg_sizes), info.args_num);
+    }
+
+    void write_binary_thread_name(const char *name)
+    {
+        if (strncmp(name, last_name_, sizeof(last_name_)) == 0)
+            return;
+        size_t len = strnlen(name, sizeof(last_name_) - 1);
+        memcpy(last_name_, name, len);
+        last_name_[len] = '\0';
+        binary_log::thread_name_entry entry;
+        entry.len = static_cast<uint8_t>(len);
+        char type = binary_log::ENTRY_THREAD_NAME;
+        file_->append(&type, 1);
+        file_->append(reinterpret_cast<const char *>(&entry), sizeof(entry));
+        file_->append(last_name_, entry.len);
+    }
+
+    void write_binary_log(const char *name, const staging_buffer::queue_header *header)
+    {
+        binary_log::tsc_param_entry entry;
+        uint32_t                    seq;
+        tscns_.getParams(entry.base_tsc, entry.base_ns, entry.ns_per_tsc, seq);
+        if (seq != last_param_seq_) {
+            last_param_seq_ = seq;
+            char type       = binary_log::ENTRY_TSC_PARAM;
+            file_->append(&type, 1);
+            file_->append(reinterpret_cast<const char *>(&entry), sizeof(entry));
         }
+        write_binary_thread_name(name);
+        char type = binary_log::ENTRY_LOG;
+        file_->append(&type, 1);
+        file_->append(reinterpret_cast<const char *>(header), header->size);
     }
 
   private:
-    file_appender               *file_{nullptr};
+    static constexpr size_t TIME_BUF_LEN = 19;
+
+    log_sink                    *file_{nullptr};
     std::vector<static_log_info> bg_log_infos_;
     TSCNS                       &tscns_;
-    char                         time_buf_[64];
-    time_t                       last_second_{0};
+    // on the heap rather than the stack, a signal handler may run on a small
+    // alternate stack
+    char                        *output_buf_;
+    char                        *large_buf_{nullptr};
+    size_t                       large_buf_size_{0};
+    time_cache                   own_time_;
+    time_cache                  *time_{&own_time_};
+    bool                         signal_safe_{false};
+    bool                         binary_{false};
+    time_precision               precision_{TIME_US};
+    bool                         utc_{false};
+    bool                         own_log_infos_;
+    uint32_t                     last_param_seq_{0};
+    char                         last_name_[16] = {0};
 };
@@ -0,0 +1,45 @@
+#pragma once
+#include <stddef.h>
+#include <string.h>
+#include <unistd.h>
+
+// Destination of the formatted (or binary) log stream. log_handler calls it
+// from the poller thread only.
+class log_sink
+{
+  public:
+    virtual ~log_sink()
+    {
+    }
+    virtual void append(const char *data, const size_t len) = 0;
+    virtual void flush()                                    = 0;
+    // called from a signal handler, append and flush must stick to
+    // async-signal-safe calls like write(2) from now on
+    virtual void enter_crash_mode()
+    {
+    }
+
+  protected:
+    // prints "<what> failed <err>" with write(2), for the failures append
+    // and flush can run into in crash mode where fprintf is not allowed
+    static void report_error(const char *what, int err)
+    {
+        char   buf[128];
+        size_t len = strnlen(what, sizeof(buf) - 32);
+        memcpy(buf, what, len);
+        memcpy(buf + len, " failed ", 8);
+        len += 8;
+        char     digits[16];
+        char    *p = digits + sizeof(digits);
+        unsigned v = static_cast<unsigned>(err);
+        do {
+            *--p = static_cast<char>('0' + v % 10);
+            v /= 10;
+        } while (v);
+        memcpy(buf + len, p, digits + sizeof(digits) - p);
+        len += digits + sizeof(digits) - p;
+        buf[len++] = '\n';
+        ssize_t n  = ::write(STDERR_FILENO, buf, len);
+        (void)n;
+    }
+};
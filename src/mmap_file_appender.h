@@ -0,0 +1,136 @@
+#pragma once
+#include "log_sink.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+// Sink copying records straight into a shared mapping of the file. The file
+// is extended and mapped window_bytes at a time, there is no syscall per
+// record and everything appended is in the page cache right away, so the
+// lines survive a crash of the process. The file is cut back to its real
+// size on close, after a crash it ends with zeros up to the window end.
+class mmap_file_appender : public log_sink
+{
+  public:
+    explicit mmap_file_appender(const char *filename, size_t window_bytes = 64 * 1024 * 1024) : window_bytes_(window_bytes)
+    {
+        long page     = ::sysconf(_SC_PAGESIZE);
+        page_bytes_   = page > 0 ? static_cast<size_t>(page) : 4096;
+        window_bytes_ = (window_bytes_ + page_bytes_ - 1) / page_bytes_ * page_bytes_;
+        if (window_bytes_ == 0)
+            window_bytes_ = page_bytes_;
+        fd_ = ::open(filename, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+        if (fd_ < 0) {
+            fprintf(stderr, "mmap_file_appender: open %s failed %d\n", filename, errno);
+            return;
+        }
+        struct stat st;
+        if (::fstat(fd_, &st) == 0) {
+            file_bytes_ = st.st_size;
+        }
+        map_window(file_bytes_);
+    }
+    ~mmap_file_appender()
+    {
+        unmap_window();
+        if (fd_ >= 0) {
+            if (::ftruncate(fd_, file_bytes_) != 0) {
+                fprintf(stderr, "mmap_file_appender: ftruncate failed %d\n", errno);
+            }
+            ::close(fd_);
+        }
+    }
+
+    mmap_file_appender(const mmap_file_appender &)            = delete;
+    mmap_file_appender &operator=(const mmap_file_appender &) = delete;
+
+    void append(const char *data, const size_t len) override
+    {
+        size_t remain = len;
+        while (remain > 0) {
+            if (cur_ == end_ && !map_window(file_bytes_))
+                return;
+            size_t n = static_cast<size_t>(end_ - cur_) < remain ? static_cast<size_t>(end_ - cur_) : remain;
+            memcpy(cur_, data, n);
+            cur_ += n;
+            data += n;
+            remain -= n;
+            file_bytes_ += n;
+        }
+    }
+
+    // starts writeback of what was appended, does not wait for it
+    void flush() override
+    {
+        if (!window_)
+            return;
+        char *begin = window_ + (synced_ - window_off_);
+        char *end   = window_ + ((cur_ - window_) + page_bytes_ - 1) / page_bytes_ * page_bytes_;
+        if (end > begin) {
+            ::msync(begin, end - begin, MS_ASYNC);
+        }
+        synced_ = window_off_ + (cur_ - window_) / page_bytes_ * page_bytes_;
+    }
+
+    off_t writtenBytes() const
+    {
+        return file_bytes_;
+    }
+
+  private:
+    // maps the window holding offset off, the mapping starts page aligned
+    bool map_window(off_t off)
+    {
+        if (fd_ < 0)
+            return false;
+        unmap_window();
+        off_t  aligned = off / page_bytes_ * page_bytes_;
+        off_t  limit   = aligned + static_cast<off_t>(window_bytes_);
+        struct stat st;
+        if (::fstat(fd_, &st) != 0 || st.st_size < limit) {
+            // allocate the blocks now rather than on the page faults
+            if (::fallocate(fd_, 0, aligned, window_bytes_) != 0 && ::ftruncate(fd_, limit) != 0) {
+                report_error("mmap_file_appender: extending the file", errno);
+                return false;
+            }
+        }
+        void *p = ::mmap(nullptr, window_bytes_, PROT_READ | PROT_WRITE, MAP_SHARED, fd_, aligned);
+        if (p == MAP_FAILED) {
+            report_error("mmap_file_appender: mmap", errno);
+            return false;
+        }
+        ::madvise(p, window_bytes_, MADV_SEQUENTIAL);
+        window_     = static_cast<char *>(p);
+        window_off_ = aligned;
+        synced_     = aligned;
+        cur_        = window_ + (off - aligned);
+        end_        = window_ + window_bytes_;
+        return true;
+    }
+
+    void unmap_window()
+    {
+        if (!window_)
+            return;
+        flush();
+        ::munmap(window_, window_bytes_);
+        window_ = cur_ = end_ = nullptr;
+    }
+
+  private:
+    int    fd_{-1};
+    size_t window_bytes_;
+    size_t page_bytes_;
+    char  *window_{nullptr};
+    char  *cur_{nullptr};
+    char  *end_{nullptr};
+    off_t  window_off_{0};
+    off_t  synced_{0};
+    off_t  file_bytes_{0};
+};
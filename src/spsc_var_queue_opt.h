@@ -1,7 +1,17 @@
 #pragma once
+#include <atomic>
+#include <linux/mempolicy.h>
 #include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
 
-template <uint32_t Bytes>
+// capacity is chosen at runtime so every staging buffer can be sized on its own.
+// Each side publishes its index with a release store and keeps a cached copy
+// of the other side's, so it only reads the other core's line when the cache
+// runs out. Several messages can be published, or popped, with one store.
 class SPSCVarQueueOPT
 {
   public:
@@ -9,54 +19,139 @@ class SPSCVarQueueOPT
     {
         // size of this msg, including header itself
         // auto set by lib, can be read by user
-        uint16_t size;
-        uint16_t msg_type;
+        uint32_t size;
         // userdata can be used by caller, e.g. save timestamp or other stuff
-        // we assume that user_msg is 8 types alligned so there'll be 4 bytes padding anyway, otherwise we can choose to
-        // eliminate userdata
         uint32_t userdata;
     };
-    static constexpr uint32_t BLK_CNT = Bytes / sizeof(MsgHeader);
-
-    MsgHeader *alloc(uint16_t size_)
-    {
-        size            = size_ + sizeof(MsgHeader);
-        uint32_t blk_sz = (size + sizeof(MsgHeader) - 1) / sizeof(MsgHeader);
-        if (blk_sz >= free_write_cnt) {
-            asm volatile("" : "=m"(read_idx) : :); // force read memory
-            uint32_t read_idx_cache = read_idx;
-            if (read_idx_cache <= write_idx) {
-                free_write_cnt = BLK_CNT - write_idx;
-                if (blk_sz >= free_write_cnt && read_idx_cache != 0) { // wrap around
-                    blk[0].size = 0;
-                    asm volatile("" : : "m"(blk) :); // memory fence
-                    blk[write_idx].size = 1;
-                    write_idx           = 0;
-                    free_write_cnt      = read_idx_cache;
+    // the node mask passed to mbind is one word, higher nodes are not bound
+    static constexpr int NUMA_NODE_LIMIT = sizeof(unsigned long) * 8;
+
+    // The ring is mapped on its own and touched here. huge_pages tries
+    // MAP_HUGETLB and falls back to transparent huge pages, a numa_node in
+    // [0, NUMA_NODE_LIMIT) binds the pages to that node, lock_memory keeps
+    // them resident.
+    explicit SPSCVarQueueOPT(uint32_t bytes, bool huge_pages = false, bool lock_memory = false, int numa_node = -1)
+        : blk_cnt_(bytes / sizeof(MsgHeader)), numa_node_(numa_node < NUMA_NODE_LIMIT ? numa_node : -1)
+    {
+        size_t align = huge_pages ? HUGE_PAGE_BYTES : 4096;
+        alloc_bytes_ = (blk_cnt_ * sizeof(MsgHeader) + align - 1) & ~(align - 1);
+        void *p      = MAP_FAILED;
+        if (huge_pages) {
+            p = mmap(nullptr, alloc_bytes_, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        }
+        if (p == MAP_FAILED) {
+            p = mmap(nullptr, alloc_bytes_, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if (p == MAP_FAILED)
+                abort();
+            if (huge_pages)
+                madvise(p, alloc_bytes_, MADV_HUGEPAGE);
+        }
+        blk_ = static_cast<MsgHeader *>(p);
+        if (numa_node_ >= 0) {
+            // no libnuma, the policy has to be set before the pages are faulted.
+            // maxnode counts one past the last bit the kernel reads.
+            unsigned long mask = 1UL << numa_node_;
+            syscall(SYS_mbind, blk_, alloc_bytes_, MPOL_BIND, &mask, sizeof(mask) * 8 + 1, 0);
+        }
+        memset(blk_, 0, alloc_bytes_);
+        if (lock_memory)
+            mlock(blk_, alloc_bytes_);
+        free_write_cnt_ = blk_cnt_;
+    }
+    ~SPSCVarQueueOPT()
+    {
+        munmap(blk_, alloc_bytes_);
+    }
+    SPSCVarQueueOPT(const SPSCVarQueueOPT &)            = delete;
+    SPSCVarQueueOPT &operator=(const SPSCVarQueueOPT &) = delete;
+
+    uint32_t capacity() const
+    {
+        return blk_cnt_ * sizeof(MsgHeader);
+    }
+
+    int numa_node() const
+    {
+        return numa_node_;
+    }
+
+    // only when both sides are idle and everything was popped
+    void reset()
+    {
+        write_pos_      = 0;
+        free_write_cnt_ = blk_cnt_;
+        read_idx_cache_ = 0;
+        write_idx_.store(0, std::memory_order_relaxed);
+        read_pos_        = 0;
+        released_pos_    = 0;
+        write_idx_cache_ = 0;
+        read_idx_.store(0, std::memory_order_release);
+    }
+
+    // producer side: true once the consumer released everything pushed so far
+    bool drained()
+    {
+        return read_idx_.load(std::memory_order_acquire) == write_pos_;
+    }
+
+    MsgHeader *alloc(uint32_t size)
+    {
+        size_           = size + sizeof(MsgHeader);
+        uint32_t blk_sz = (size_ + sizeof(MsgHeader) - 1) / sizeof(MsgHeader);
+        if (blk_sz >= free_write_cnt_) {
+            // only now look at the consumer's line, free_write_cnt_ is a
+            // lower bound of the free space until then
+            read_idx_cache_ = read_idx_.load(std::memory_order_acquire);
+            if (read_idx_cache_ <= write_pos_) {
+                free_write_cnt_ = blk_cnt_ - write_pos_;
+                if (blk_sz >= free_write_cnt_ && read_idx_cache_ != 0) { // wrap around
+                    // the marker is published with the next message
+                    blk_[write_pos_].size = 1;
+                    write_pos_            = 0;
+                    free_write_cnt_       = read_idx_cache_;
                 }
             } else {
-                free_write_cnt = read_idx_cache - write_idx;
+                free_write_cnt_ = read_idx_cache_ - write_pos_;
             }
-            if (free_write_cnt <= blk_sz) {
+            if (free_write_cnt_ <= blk_sz) {
                 return nullptr;
             }
         }
-        return &blk[write_idx];
+        return &blk_[write_pos_];
+    }
+
+    // the allocated message only used size bytes, e.g. a record written
+    // into a worst case allocation, the rest goes back to the ring
+    void shrink(uint32_t size)
+    {
+        size_ = size + sizeof(MsgHeader);
     }
 
+    // commits the allocated message and publishes it with everything
+    // committed before
     void push()
     {
-        uint32_t blk_sz              = (size + sizeof(MsgHeader) - 1) / sizeof(MsgHeader);
-        blk[write_idx + blk_sz].size = 0;
+        commit();
+        publish();
+    }
 
-        asm volatile("" : : "m"(blk) :); // memory fence
-        blk[write_idx].size = size;
-        write_idx += blk_sz;
-        free_write_cnt -= blk_sz;
+    // commits the allocated message, the consumer sees it after publish()
+    void commit()
+    {
+        uint32_t blk_sz       = (size_ + sizeof(MsgHeader) - 1) / sizeof(MsgHeader);
+        blk_[write_pos_].size = size_;
+        write_pos_ += blk_sz;
+        free_write_cnt_ -= blk_sz;
+    }
+
+    // one release store for any number of committed messages
+    void publish()
+    {
+        write_idx_.store(write_pos_, std::memory_order_release);
     }
 
     template <typename Writer>
-    bool tryPush(uint16_t size, Writer writer)
+    bool tryPush(uint32_t size, Writer writer)
     {
         MsgHeader *header = alloc(size);
         if (!header)
@@ -68,23 +163,39 @@ class SPSCVarQueueOPT
 
     MsgHeader *front()
     {
-        asm volatile("" : "=m"(blk) : :); // force read memory
-        uint16_t size = blk[read_idx].size;
-        if (size == 1) { // wrap around
-            read_idx = 0;
-            size     = blk[0].size;
+        if (read_pos_ == write_idx_cache_) {
+            write_idx_cache_ = write_idx_.load(std::memory_order_acquire);
+            if (read_pos_ == write_idx_cache_)
+                return nullptr;
+        }
+        if (blk_[read_pos_].size == 1) { // wrap around
+            read_pos_ = 0;
+            if (read_pos_ == write_idx_cache_)
+                return nullptr;
         }
-        if (size == 0)
-            return nullptr;
-        return &blk[read_idx];
+        return &blk_[read_pos_];
     }
 
+    // the space is handed back to the producer by release(), or once a
+    // quarter of the ring was popped
     void pop()
     {
-        asm volatile("" : "=m"(blk) : "m"(read_idx) :); // memory fence
-        uint32_t blk_sz = (blk[read_idx].size + sizeof(MsgHeader) - 1) / sizeof(MsgHeader);
-        read_idx += blk_sz;
-        asm volatile("" : : "m"(read_idx) :); // force write memory
+        uint32_t blk_sz = (blk_[read_pos_].size + sizeof(MsgHeader) - 1) / sizeof(MsgHeader);
+        read_pos_ += blk_sz;
+        popped_blks_ += blk_sz;
+        if (popped_blks_ >= blk_cnt_ / 4)
+            release();
+    }
+
+    // one store for every message popped since the last release, call it
+    // when done with a run of pops
+    void release()
+    {
+        if (read_pos_ != released_pos_) {
+            released_pos_ = read_pos_;
+            popped_blks_  = 0;
+            read_idx_.store(read_pos_, std::memory_order_release);
+        }
     }
 
     template <typename Reader>
@@ -95,15 +206,34 @@ class SPSCVarQueueOPT
             return false;
         reader(header);
         pop();
+        release();
         return true;
     }
 
   private:
-    alignas(64) MsgHeader blk[BLK_CNT] = {};
+    static constexpr size_t HUGE_PAGE_BYTES = 2 * 1024 * 1024;
+
+    MsgHeader *blk_;
+    uint32_t   blk_cnt_;
+    size_t     alloc_bytes_;
+    int        numa_node_;
+
+    // producer side, write_pos_ runs ahead of write_idx_ by the messages
+    // committed but not published yet
+    alignas(128) uint32_t write_pos_ = 0;
+    uint32_t free_write_cnt_;
+    uint32_t read_idx_cache_ = 0;
+    uint32_t size_;
 
-    alignas(128) uint32_t write_idx = 0;
-    uint32_t free_write_cnt         = BLK_CNT;
-    uint16_t size;
+    // each index the other side reads sits alone on its line, the writer
+    // of a line never has to win it back from the other core's reads of
+    // its private fields
+    alignas(128) std::atomic<uint32_t> write_idx_{0};
+    alignas(128) std::atomic<uint32_t> read_idx_{0};
 
-    alignas(128) uint32_t read_idx = 0;
+    // consumer side
+    alignas(128) uint32_t read_pos_ = 0;
+    uint32_t released_pos_    = 0;
+    uint32_t popped_blks_     = 0;
+    uint32_t write_idx_cache_ = 0;
 };
@@ -1,37 +1,227 @@
 #pragma once
 #include "spsc_var_queue_opt.h"
+#include "utils.h"
+#include <atomic>
 #include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <sys/syscall.h>
 #include <unistd.h>
+
+enum overflow_policy : uint8_t
+{
+    // drop the message and count it
+    OVERFLOW_DROP = 0,
+    // spin until the poller freed enough space
+    OVERFLOW_BLOCK = 1,
+    // continue in a secondary ring until the poller drained it
+    OVERFLOW_SPILL = 2,
+};
+
+enum large_msg_policy : uint8_t
+{
+    // keep the record in a heap block, the ring only carries a reference
+    LARGE_MSG_OUT_OF_LINE = 0,
+    // cut the longest string arguments until the record fits inline
+    LARGE_MSG_TRUNCATE = 1,
+    // drop the message and count it
+    LARGE_MSG_DROP = 2,
+};
+
+struct staging_buffer_options
+{
+    uint32_t         queue_bytes{1024 * 1024 * 4};
+    overflow_policy  policy{OVERFLOW_DROP};
+    // size of the secondary ring for OVERFLOW_SPILL
+    uint32_t         spill_bytes{1024 * 1024};
+    // back the rings with transparent huge pages
+    bool             huge_pages{false};
+    // mlock the rings, needs RLIMIT_MEMLOCK, ignored when it fails
+    bool             lock_memory{false};
+    // bind the rings to the NUMA node the allocating thread runs on
+    bool             numa_local{false};
+    // records above this size are handled by large_policy instead of going
+    // into the ring, e.g. an occasional order book dump
+    uint32_t         large_msg_bytes{64 * 1024};
+    large_msg_policy large_policy{LARGE_MSG_OUT_OF_LINE};
+    // varint integers and a timestamp delta against the previous record,
+    // more messages per ring at the cost of encoding them
+    bool             compact_records{false};
+};
+
+struct staging_buffer_stats
+{
+    char     name[16];
+    // messages and payload bytes successfully queued
+    uint64_t msgs;
+    uint64_t bytes;
+    uint64_t dropped;
+    // max queued payload bytes observed by the poller
+    uint64_t high_water_bytes;
+    uint32_t capacity;
+};
+
 class staging_buffer
 {
   public:
-    using queue_header = SPSCVarQueueOPT<1024 * 1024 * 4>::MsgHeader;
-    staging_buffer() : varq_()
+    using queue_header = SPSCVarQueueOPT::MsgHeader;
+    // userdata of a ring record that only carries the address of an out of
+    // line one, front() hands out the latter
+    static constexpr uint32_t LARGE_MSG_REF = UINT32_MAX;
+    // userdata bit of a record written by write_compact
+    static constexpr uint32_t COMPACT_RECORD = 1u << 31;
+    explicit staging_buffer(const staging_buffer_options &opts = staging_buffer_options())
+        : varq_(opts.queue_bytes, opts.huge_pages, opts.lock_memory, numa_node_for(opts)), policy_(opts.policy), opts_(opts),
+          large_msg_bytes_(opts.large_msg_bytes), compact_(opts.compact_records)
     {
-        uint32_t tid = static_cast<pid_t>(syscall(SYS_gettid));
-        snprintf(name_, sizeof(name_), "%d", tid);
+        set_thread_name();
+        if (policy_ == OVERFLOW_SPILL) {
+            spill_ = new SPSCVarQueueOPT(opts.spill_bytes, opts.huge_pages, opts.lock_memory, varq_.numa_node());
+        }
+        if (compact_) {
+            // a compact record is never larger than large_msg_bytes
+            expanded_ = static_cast<queue_header *>(malloc(sizeof(queue_header) + sizeof(uint64_t) + large_msg_bytes_));
+        }
     }
     ~staging_buffer()
     {
+        // a record the poller never got to
+        while (auto header = front()) {
+            pop(header);
+        }
+        delete spill_;
+        free(expanded_);
+    }
+    // string_sizes as computed by details::get_arg_sizes, LARGE_MSG_TRUNCATE
+    // shortens them
+    template <int M>
+    inline queue_header *alloc(size_t nbytes, size_t (&string_sizes)[M])
+    {
+        if (nbytes > large_msg_bytes_ && opts_.large_policy == LARGE_MSG_TRUNCATE) {
+            nbytes -= details::truncate_strings(string_sizes, nbytes - large_msg_bytes_);
+        }
+        return alloc(nbytes);
     }
     inline queue_header *alloc(size_t nbytes)
     {
-        return varq_.alloc(nbytes);
+        if (nbytes > large_msg_bytes_)
+            return alloc_large(nbytes);
+        return alloc_inline(nbytes);
+    }
+    bool compact_records() const
+    {
+        return compact_;
+    }
+    // Writes a record in the compact encoding: a varint of the timestamp
+    // delta to the previous compact record, then the arguments as
+    // store_compact_arguments lays them out. The worst case is allocated and
+    // the rest given back. false when even that is beyond large_msg_bytes,
+    // the caller writes the usual record then.
+    template <int M, typename... Ts>
+    inline bool write_compact(uint32_t log_id, uint64_t timestamp, size_t arg_size, size_t (&string_sizes)[M], Ts... args)
+    {
+        using layout  = details::arg_layout<Ts...>;
+        size_t nbytes = details::MAX_VARINT_BYTES + layout::compact_max_size + (arg_size - layout::fixed_size);
+        if (nbytes > large_msg_bytes_)
+            return false;
+        auto header = alloc_inline(nbytes);
+        if (!header)
+            return true;
+        header->userdata = log_id | COMPACT_RECORD;
+        char *begin      = reinterpret_cast<char *>(header + 1);
+        char *p          = details::write_varint(begin, details::zigzag(static_cast<int64_t>(timestamp - write_tsc_)));
+        details::store_compact_arguments(string_sizes, &p, args...);
+        write_tsc_ = timestamp;
+        finish(p - begin);
+        return true;
+    }
+    inline queue_header *alloc_inline(size_t nbytes)
+    {
+        pending_bytes_ = nbytes;
+        if (spilling_) {
+            // keep the order, stay on the spill ring until the poller caught up
+            if (!spill_->drained())
+                return alloc_spill(nbytes);
+            spilling_ = false;
+        }
+        auto header = varq_.alloc(nbytes);
+        if (header)
+            return header;
+        return alloc_overflow(nbytes);
     }
     inline void finish()
     {
-        varq_.push();
+        // single writer, plain load/store instead of a locked add
+        msgs_.store(msgs_.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+        bytes_.store(bytes_.load(std::memory_order_relaxed) + pending_bytes_, std::memory_order_relaxed);
+        if (spilling_) {
+            spill_->push();
+        } else {
+            varq_.push();
+        }
+    }
+    // finish() of a record that used only nbytes of the ones allocated
+    inline void finish(size_t nbytes)
+    {
+        pending_bytes_ = nbytes;
+        if (spilling_) {
+            spill_->shrink(static_cast<uint32_t>(nbytes));
+        } else {
+            varq_.shrink(static_cast<uint32_t>(nbytes));
+        }
+        finish();
     }
     queue_header *front()
     {
-        return varq_.front();
+        auto header = front_ring();
+        if (!header)
+            return nullptr;
+        if (header->userdata == LARGE_MSG_REF) {
+            memcpy(&front_large_, header + 1, sizeof(front_large_));
+            return front_large_;
+        }
+        if (header->userdata & COMPACT_RECORD)
+            return expand(header);
+        return header;
+    }
+    // the log id of a record front() handed out
+    static uint32_t log_id(const queue_header *header)
+    {
+        return header->userdata & ~COMPACT_RECORD;
+    }
+    inline void pop(const queue_header *header)
+    {
+        if (header == expanded_) {
+            header         = expanded_from_;
+            expanded_from_ = nullptr;
+        }
+        read_bytes_ += header->size - sizeof(queue_header);
+        if (front_large_ == header) {
+            // free is not async-signal-safe, a crash drain leaks the block
+            if (!signal_safe_.load(std::memory_order_relaxed))
+                free(front_large_);
+            front_large_ = nullptr;
+        }
+        if (front_in_spill_) {
+            spill_->pop();
+        } else {
+            varq_.pop();
+        }
+    }
+    // hands the space of the messages popped so far back to the producer,
+    // pollers call it at the end of each run of pops
+    inline void release()
+    {
+        varq_.release();
+        if (spill_)
+            spill_->release();
     }
-    inline void pop()
+    // names the buffer after the calling thread
+    void set_thread_name()
     {
-        varq_.pop();
+        uint32_t tid = static_cast<pid_t>(syscall(SYS_gettid));
+        snprintf(name_, sizeof(name_), "%d", tid);
     }
     void set_name(const char *name)
     {
@@ -42,18 +232,220 @@ class staging_buffer
         return name_;
     }
 
+    uint64_t get_dropped() const
+    {
+        return dropped_.load(std::memory_order_relaxed);
+    }
+
+    // called by the poller before draining, occupancy only grows in between
+    void update_high_water()
+    {
+        uint64_t queued = bytes_.load(std::memory_order_relaxed) - read_bytes_;
+        if (queued > high_water_.load(std::memory_order_relaxed)) {
+            high_water_.store(queued, std::memory_order_relaxed);
+        }
+    }
+
+    void get_stats(staging_buffer_stats &stats) const
+    {
+        memcpy(stats.name, name_, sizeof(stats.name));
+        stats.msgs             = msgs_.load(std::memory_order_relaxed);
+        stats.bytes            = bytes_.load(std::memory_order_relaxed);
+        stats.dropped          = dropped_.load(std::memory_order_relaxed);
+        stats.high_water_bytes = high_water_.load(std::memory_order_relaxed);
+        stats.capacity         = varq_.capacity();
+    }
+
+    // the acquire pairs with the release in set_delete_flag, a front() after
+    // it sees every message the thread pushed
     bool check_can_delete()
     {
-        return should_deallocate_;
+        return should_deallocate_.load(std::memory_order_acquire);
     }
 
+    // the owning thread's last call, after its last push
     void set_delete_flag()
     {
-        should_deallocate_ = true;
+        should_deallocate_.store(true, std::memory_order_release);
+    }
+
+    // no more heap calls from pop(), see fast_logger::crash_drain
+    static void set_signal_safe()
+    {
+        signal_safe_.store(true, std::memory_order_relaxed);
+    }
+
+    // the node a buffer allocated now by the calling thread would be bound to
+    static int numa_node_for(const staging_buffer_options &opts)
+    {
+        unsigned cpu, node;
+        if (!opts.numa_local || syscall(SYS_getcpu, &cpu, &node, nullptr) != 0 || node >= SPSCVarQueueOPT::NUMA_NODE_LIMIT)
+            return -1;
+        return static_cast<int>(node);
+    }
+
+    bool same_options(const staging_buffer_options &opts, int numa_node) const
+    {
+        return opts.queue_bytes == opts_.queue_bytes && opts.policy == opts_.policy && (opts.policy != OVERFLOW_SPILL || opts.spill_bytes == opts_.spill_bytes) &&
+               opts.huge_pages == opts_.huge_pages && opts.lock_memory == opts_.lock_memory && numa_node == varq_.numa_node() &&
+               opts.large_msg_bytes == opts_.large_msg_bytes && opts.large_policy == opts_.large_policy && opts.compact_records == opts_.compact_records;
+    }
+
+    // called by the poller on a drained buffer of an exited thread, so that
+    // another thread can take it over
+    void reset()
+    {
+        varq_.reset();
+        if (spill_)
+            spill_->reset();
+        spilling_       = false;
+        front_in_spill_ = false;
+        front_large_    = nullptr;
+        expanded_from_  = nullptr;
+        pending_bytes_  = 0;
+        write_tsc_      = 0;
+        read_tsc_       = 0;
+        msgs_.store(0, std::memory_order_relaxed);
+        bytes_.store(0, std::memory_order_relaxed);
+        dropped_.store(0, std::memory_order_relaxed);
+        read_bytes_ = 0;
+        high_water_.store(0, std::memory_order_relaxed);
+        should_deallocate_.store(false, std::memory_order_relaxed);
+        next_registered_   = nullptr;
+    }
+
+    // link of the logger's registration stack
+    void set_next_registered(staging_buffer *next)
+    {
+        next_registered_ = next;
+    }
+    staging_buffer *get_next_registered() const
+    {
+        return next_registered_;
     }
 
   private:
-    SPSCVarQueueOPT<1024 * 1024 * 4> varq_;
-    char                             name_[16] = {0};
-    bool                             should_deallocate_{false};
-};
\ No newline at end of file
+    queue_header *front_ring()
+    {
+        auto header = varq_.front();
+        if (header || !spill_) {
+            front_in_spill_ = false;
+            return header;
+        }
+        header = spill_->front();
+        if (!header)
+            return nullptr;
+        // the producer only spills once the primary ring was full, anything
+        // it pushed there before is older than the spilled message
+        auto primary    = varq_.front();
+        front_in_spill_ = primary == nullptr;
+        return primary ? primary : header;
+    }
+
+    // The delta timestamp of a compact record only resolves in ring order, so
+    // front() does it here: the record is copied with the absolute timestamp
+    // in front of the arguments, which log_handler decodes. Called again for
+    // the same record it returns the same copy.
+    queue_header *expand(const queue_header *header)
+    {
+        if (header == expanded_from_)
+            return expanded_;
+        const char *p = reinterpret_cast<const char *>(header + 1);
+        read_tsc_ += static_cast<uint64_t>(details::unzigzag(details::read_varint(p)));
+        size_t args         = reinterpret_cast<const char *>(header) + header->size - p;
+        expanded_from_      = header;
+        expanded_->size     = static_cast<uint32_t>(sizeof(queue_header) + sizeof(read_tsc_) + args);
+        expanded_->userdata = header->userdata;
+        char *out           = reinterpret_cast<char *>(expanded_ + 1);
+        memcpy(out, &read_tsc_, sizeof(read_tsc_));
+        memcpy(out + sizeof(read_tsc_), p, args);
+        return expanded_;
+    }
+
+    // the record goes to the heap, the ring gets a reference to it that
+    // takes the same path as any other record
+    queue_header *alloc_large(size_t nbytes)
+    {
+        if (opts_.large_policy != LARGE_MSG_OUT_OF_LINE || nbytes + sizeof(queue_header) > UINT32_MAX) {
+            count_drop();
+            return nullptr;
+        }
+        queue_header *ref = alloc_inline(sizeof(queue_header *));
+        if (!ref)
+            return nullptr;
+        auto large = static_cast<queue_header *>(malloc(sizeof(queue_header) + nbytes));
+        if (!large) {
+            count_drop();
+            return nullptr;
+        }
+        ref->userdata = LARGE_MSG_REF;
+        memcpy(ref + 1, &large, sizeof(large));
+        large->size    = static_cast<uint32_t>(sizeof(queue_header) + nbytes);
+        pending_bytes_ = nbytes;
+        return large;
+    }
+
+    queue_header *alloc_overflow(size_t nbytes)
+    {
+        // would never fit, whatever the policy
+        if (nbytes + 2 * sizeof(queue_header) >= varq_.capacity()) {
+            count_drop();
+            return nullptr;
+        }
+        if (policy_ == OVERFLOW_BLOCK) {
+            queue_header *header;
+            while ((header = varq_.alloc(nbytes)) == nullptr) {
+                details::cpu_relax();
+            }
+            return header;
+        }
+        if (policy_ == OVERFLOW_SPILL) {
+            spilling_ = true;
+            return alloc_spill(nbytes);
+        }
+        count_drop();
+        return nullptr;
+    }
+
+    queue_header *alloc_spill(size_t nbytes)
+    {
+        auto header = spill_->alloc(nbytes);
+        if (!header)
+            count_drop();
+        return header;
+    }
+
+    void count_drop()
+    {
+        dropped_.store(dropped_.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    }
+
+  private:
+    SPSCVarQueueOPT        varq_;
+    SPSCVarQueueOPT       *spill_{nullptr};
+    overflow_policy        policy_;
+    staging_buffer_options opts_;
+    bool                   spilling_{false};
+    bool                   front_in_spill_{false};
+    size_t                 pending_bytes_{0};
+    uint32_t               large_msg_bytes_;
+    bool                   compact_;
+    // timestamp of the last compact record written
+    uint64_t               write_tsc_{0};
+    std::atomic<uint64_t>  msgs_{0};
+    std::atomic<uint64_t>  bytes_{0};
+    std::atomic<uint64_t>  dropped_{0};
+    // poller side
+    alignas(64) uint64_t   read_bytes_{0};
+    std::atomic<uint64_t>  high_water_{0};
+    queue_header          *front_large_{nullptr};
+    // last compact record resolved by expand() and its copy
+    uint64_t               read_tsc_{0};
+    const queue_header    *expanded_from_{nullptr};
+    queue_header          *expanded_{nullptr};
+    char                   name_[16] = {0};
+    std::atomic<bool>      should_deallocate_{false};
+    staging_buffer        *next_registered_{nullptr};
+
+    static inline std::atomic<bool> signal_safe_{false};
+};
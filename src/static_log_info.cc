@@ -1,12 +1,15 @@
 #include "static_log_info.h"
-static format_type get_format_type(std::string length, char specifier)
+#include "utils.h"
+#include <stdio.h>
+#include <stdlib.h>
+static format_type get_format_type(const char *length, char specifier)
 {
     // Signed Integers
     if (specifier == 'd' || specifier == 'i') {
-        if (length.empty())
+        if (length[0] == '\0')
             return format_type::int_t;
 
-        if (length.size() == 2) {
+        if (length[1] != '\0') {
             if (length[0] == 'h')
                 return format_type::signed_char_t;
             if (length[0] == 'l')
@@ -31,10 +34,10 @@ static format_type get_format_type(std::string length, char specifier)
 
     // Unsigned integers
     if (specifier == 'u' || specifier == 'o' || specifier == 'x' || specifier == 'X') {
-        if (length.empty())
+        if (length[0] == '\0')
             return format_type::unsigned_int_t;
 
-        if (length.size() == 2) {
+        if (length[1] != '\0') {
             if (length[0] == 'h')
                 return format_type::unsigned_char_t;
             if (length[0] == 'l')
@@ -59,7 +62,7 @@ static format_type get_format_type(std::string length, char specifier)
 
     // Strings
     if (specifier == 's') {
-        if (length.empty())
+        if (length[0] == '\0')
             return format_type::const_char_ptr_t;
         if (length[0] == 'l')
             return format_type::const_wchar_t_ptr_t;
@@ -67,94 +70,93 @@ static format_type get_format_type(std::string length, char specifier)
 
     // Pointer
     if (specifier == 'p') {
-        if (length.empty())
+        if (length[0] == '\0')
             return format_type::const_void_ptr_t;
     }
 
     // Floating points
     if (specifier == 'f' || specifier == 'F' || specifier == 'e' || specifier == 'E' || specifier == 'g' || specifier == 'G' || specifier == 'a' ||
         specifier == 'A') {
-        if (length.size() == 1 && length[0] == 'L')
+        if (length[0] == 'L')
             return format_type::long_double_t;
         else
             return format_type::double_t;
     }
 
     if (specifier == 'c') {
-        if (length.empty())
+        if (length[0] == '\0')
             return format_type::int_t;
         if (length[0] == 'l')
             return format_type::wint_t_t;
     }
 
-    fprintf(stderr, "Attempt to decode format specifier failed: %s%c\r\n", length.c_str(), specifier);
+    fprintf(stderr, "Attempt to decode format specifier failed: %s%c\r\n", length, specifier);
     return format_type::MAX_FORMAT_TYPE;
 }
+// copies src to dst turning "%%" into "%", returns the bytes written
+static size_t unescape_literal(char *dst, const char *src, size_t len)
+{
+    size_t n = 0;
+    for (size_t i = 0; i < len; i++) {
+        dst[n++] = src[i];
+        if (src[i] == '%' && i + 1 < len && src[i + 1] == '%')
+            i++;
+    }
+    return n;
+}
+
 bool static_log_info::create_log_fragments(char **microCode)
 {
     char *micro_code_starting_pos = *microCode;
     fragments                     = micro_code_starting_pos;
-    size_t format_str_length      = strlen(fmt_str) + 1;
-
-    size_t            i = 0;
-    std::cmatch       match;
-    int               consecutive_percents   = 0;
-    size_t            start_of_next_fragment = 0;
-    print_fragment   *pf                     = nullptr;
-    static std::regex regex("^%"
-                            "([-+ #0]+)?"            // Flags (Position 1)
-                            "([\\d]+|\\*)?"          // Width (Position 2)
-                            "(\\.(\\d+|\\*))?"       // Precision (Position 4; 3 includes '.')
-                            "(hh|h|l|ll|j|z|Z|t|L)?" // Length (Position 5)
-                            "([diuoxXfFeEgGaAcspn])" // Specifier (Position 6)
-    );
+    size_t format_str_length      = strlen(fmt_str);
+
+    size_t          i                      = 0;
+    size_t          start_of_next_fragment = 0;
+    print_fragment *pf                     = nullptr;
     // The key idea here is to split up the format string in to fragments (i.e.
     // PrintFragments) such that there is at most one specifier per fragment.
     // This then allows the decompressor later to consume one argument at a
     // time and print the fragment (vs. buffering all the arguments first).
+    //
+    // Each fragment is compiled as well: the literal text in front of the
+    // specifier is unescaped and the specifier is parsed once here, so that
+    // log_handler formats without re-parsing the fragment for every log.
 
     while (i < format_str_length) {
-        char c = fmt_str[i];
-        // Skip the next character if there's an escape
-        if (c == '\\') {
-            i += 2;
-            continue;
-        }
-
-        if (c != '%') {
+        if (fmt_str[i] != '%') {
             ++i;
-            consecutive_percents = 0;
             continue;
         }
 
-        // If there's an even number of '%'s, then it's a comment
-        if (++consecutive_percents % 2 == 0 || !std::regex_search(fmt_str + i, match, regex)) {
-            ++i;
+        // "%%" is a literal '%', anything that does not parse is kept as is
+        details::format_conversion conv = details::parse_conversion(fmt_str + i);
+        if (conv.length == 0) {
+            i += fmt_str[i + 1] == '%' ? 2 : 1;
             continue;
         }
+        size_t spec_start = i;
+        i += conv.length;
 
-        // Advance the pointer to the end of the specifier & reset the % counter
-        consecutive_percents = 0;
-        i += match.length();
-
-        // At this point we found a match, let's start analyzing it
-        pf = reinterpret_cast<print_fragment *>(*microCode);
-        *microCode += sizeof(print_fragment);
-
-        std::string width     = match[2].str();
-        std::string precision = match[4].str();
-        std::string length    = match[5].str();
-        char        specifier = match[6].str()[0];
-        format_type type      = get_format_type(length, specifier);
+        format_type type = get_format_type(conv.length_modifier, conv.spec.specifier);
         if (type == MAX_FORMAT_TYPE) {
-            fprintf(stderr, "Error: Couldn't process this: %s\r\n", match.str().c_str());
+            fprintf(stderr, "Error: Couldn't process this: %.*s\r\n", conv.length, fmt_str + spec_start);
             *microCode = micro_code_starting_pos;
             return false;
         }
 
+        // At this point we found a match, let's start analyzing it
+        pf         = print_fragment::place(*microCode);
+        *microCode = pf->format_fragment;
+
         pf->arg_type              = 0x1F & type;
-        pf->has_dynamic_width     = (width.empty()) ? false : width[0] == '*';
-        pf->has_dynamic_precision = (precision.empty()) ? false : precision[0] == '*';
+        pf->has_dynamic_width     = conv.dynamic_width;
+        pf->has_dynamic_precision = conv.dynamic_precision;
+        pf->spec                  = conv.spec;
+        memcpy(pf->length, conv.length_modifier, sizeof(pf->length));
+        pf->spec_offset = static_cast<uint16_t>(spec_start - start_of_next_fragment);
+        pf->spec_length = static_cast<uint8_t>(conv.length <= UINT8_MAX ? conv.length : 0);
+
         // Tricky tricky: We null-terminate the fragment by copying 1
         // extra byte and then setting it to NULL
         pf->fragment_length = static_cast<uint16_t>(i - start_of_next_fragment + 1);
@@ -162,28 +164,44 @@ bool static_log_info::create_log_fragments(char **microCode)
         *microCode += pf->fragment_length;
         *(*microCode - 1) = '\0';
 
+        pf->literal_length = static_cast<uint16_t>(unescape_literal(*microCode, fmt_str + start_of_next_fragment, spec_start - start_of_next_fragment));
+        *microCode += pf->literal_length;
+        pf->suffix_length = 0;
+
         start_of_next_fragment = i;
         ++num_print_fragments;
     }
 
     // If we didn't encounter any specifiers, make one for a basic string
     if (pf == nullptr) {
-        pf = reinterpret_cast<print_fragment *>(*microCode);
-        *microCode += sizeof(print_fragment);
+        pf         = print_fragment::place(*microCode);
+        *microCode = pf->format_fragment;
         num_print_fragments = 1;
 
         pf->arg_type          = format_type::NONE;
         pf->has_dynamic_width = pf->has_dynamic_precision = false;
-        pf->fragment_length                               = static_cast<uint16_t>(format_str_length);
-        memcpy(*microCode, fmt_str, format_str_length);
-        *microCode += format_str_length;
+        pf->spec                                          = details::format_spec{0, 0, -1, -1};
+        memset(pf->length, 0, sizeof(pf->length));
+        pf->spec_offset     = 0;
+        pf->spec_length     = 0;
+        pf->fragment_length = static_cast<uint16_t>(format_str_length + 1);
+        memcpy(*microCode, fmt_str, format_str_length + 1);
+        *microCode += pf->fragment_length;
+        pf->literal_length = static_cast<uint16_t>(unescape_literal(*microCode, fmt_str, format_str_length));
+        *microCode += pf->literal_length;
+        pf->suffix_length = 0;
     } else {
-        // Extend the last fragment to include the rest of the string
-        size_t endingLength = format_str_length - start_of_next_fragment;
+        // Extend the last fragment to include the rest of the string, its
+        // literal is moved behind the longer format fragment
+        size_t ending_length = format_str_length - start_of_next_fragment;
+        char  *literal       = pf->format_fragment + pf->fragment_length;
+        memmove(literal + ending_length, literal, pf->literal_length);
         memcpy(pf->format_fragment + pf->fragment_length - 1, // -1 to erase \0
-               fmt_str + start_of_next_fragment, endingLength);
-        pf->fragment_length = static_cast<uint16_t>(pf->fragment_length - 1 + endingLength);
-        *microCode += endingLength;
+               fmt_str + start_of_next_fragment, ending_length + 1);
+        pf->fragment_length = static_cast<uint16_t>(pf->fragment_length + ending_length);
+        *microCode += ending_length;
+        pf->suffix_length = static_cast<uint16_t>(unescape_literal(*microCode, fmt_str + start_of_next_fragment, ending_length));
+        *microCode += pf->suffix_length;
     }
     return true;
 }
@@ -1,7 +1,6 @@
 #pragma once
+#include "formatter.h"
 #include "level.h"
-#include <iostream>
-#include <regex>
 #include <stdint.h>
 #include <string.h>
 
@@ -16,6 +15,20 @@ struct print_fragment
     bool has_dynamic_width : 1;
     bool has_dynamic_precision : 1;
 
+    // The conversion compiled at registration, width and precision are -1
+    // when absent or dynamic. length holds the length modifier, spec_offset
+    // and spec_length locate the conversion text in format_fragment for the
+    // snprintf fallback.
+    details::format_spec spec;
+    char                 length[3];
+    uint8_t              spec_length;
+    uint16_t             spec_offset;
+
+    // Unescaped text printed before the conversion and, for the last
+    // fragment, after it. Both are stored behind format_fragment.
+    uint16_t literal_length;
+    uint16_t suffix_length;
+
     // TODO(syang0) is this necessary? The format fragment is null-terminated
     // Length of the format fragment
     uint16_t fragment_length;
@@ -23,6 +36,25 @@ struct print_fragment
     // A fragment of the original LOG statement that contains at most
     // one format specifier.
     char format_fragment[];
+
+    const char *literal() const
+    {
+        return format_fragment + fragment_length;
+    }
+    const char *suffix() const
+    {
+        return literal() + literal_length;
+    }
+    const print_fragment *next() const
+    {
+        return place(suffix() + suffix_length);
+    }
+    // fragments are laid out back to back, each one properly aligned
+    static print_fragment *place(const char *pos)
+    {
+        uintptr_t p = (reinterpret_cast<uintptr_t>(pos) + alignof(print_fragment) - 1) & ~(uintptr_t)(alignof(print_fragment) - 1);
+        return reinterpret_cast<print_fragment *>(p);
+    }
 };
 enum format_type : uint8_t
 {
@@ -56,15 +88,23 @@ enum format_type : uint8_t
 
 struct static_log_info
 {
-    constexpr static_log_info(const uint32_t line_num, log_level lelvel, const char *fmt_str, uint8_t args_num)
-        : line_num(line_num), lelvel(lelvel), fmt_str(fmt_str), args_num(args_num)
+    // arg_sizes has args_num entries, see details::arg_layout
+    constexpr static_log_info(const uint32_t line_num, log_level lelvel, const char *fmt_str, uint8_t args_num, const uint8_t *arg_sizes)
+        : line_num(line_num), lelvel(lelvel), fmt_str(fmt_str), args_num(args_num), arg_sizes(arg_sizes)
+    {
+    }
+    // upper bound of the bytes create_log_fragments writes
+    size_t          fragments_size() const
     {
+        size_t len = strlen(fmt_str) + 1;
+        return 3 * len + (len / 2 + 1) * (sizeof(print_fragment) + alignof(print_fragment));
     }
     bool            create_log_fragments(char **microCode);
     const uint32_t  line_num;
     const log_level lelvel;
     const char     *fmt_str;
     uint8_t         args_num;
+    const uint8_t  *arg_sizes;
     uint8_t         num_print_fragments{0};
     char           *fragments{nullptr};
 };
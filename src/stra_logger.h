@@ -1,3 +1,5 @@
+#pragma once
+#include "batch_file_appender.h"
 #include "file_appender.h"
 #include "level.h"
 #include "log_handler.h"
@@ -6,23 +8,31 @@
 #include "tscns.h"
 #include "utils.h"
 #include <algorithm>
+#include <atomic>
 #include <iostream>
 #include <mutex>
 #include <stdint.h>
 #include <string.h>
 
+class stra_logger_group;
+
 class stra_logger
 {
+    friend class stra_logger_group;
+
   public:
+    // loggers sharing a TSCNS calibrate it once, the first one pays for it
     stra_logger(TSCNS &tscns) : tscns_(tscns), log_handler_(tscns_)
     {
-        tscns_.init();
+        tscns_.initOnce();
+    }
+    // on the process wide clock, see TSCNS::global
+    stra_logger() : stra_logger(TSCNS::global())
+    {
     }
     ~stra_logger()
     {
-        if (staging_buffer_) {
-            delete staging_buffer_;
-        }
+        delete staging_buffer_.load(std::memory_order_relaxed);
     }
     template <int M, typename... Ts>
     inline void log(int &log_id, const int linenum, const log_level level, const char (&format)[M], Ts... args)
@@ -31,23 +41,28 @@ class stra_logger
             return;
         }
         if (log_id == UNASSIGNED_LOGID) {
-            static_log_info info(linenum, level, format, static_cast<uint8_t>(sizeof...(args)));
+            static_log_info info(linenum, level, format, static_cast<uint8_t>(sizeof...(args)), details::arg_layout<Ts...>::sizes);
             register_log(info, log_id);
         }
         uint64_t timestamp                       = tscns_.rdtsc();
         size_t   string_sizes[sizeof...(Ts) + 1] = {}; // HACK: Zero length arrays are not allowed
-        size_t   alloc_size                      = details::get_arg_sizes(string_sizes, args...) + sizeof(uint64_t);
-        auto     header                          = alloc(alloc_size);
-        if (!header) {
-            std::cout << "header is null" << std::endl;
-            return;
+        size_t   arg_size                        = details::get_arg_sizes(string_sizes, args...);
+        staging_buffer *sb                       = ensure_staging_buffer_allocated();
+        if (!sb->compact_records() || !sb->write_compact(log_id, timestamp, arg_size, string_sizes, args...)) {
+            auto header = sb->alloc(arg_size + sizeof(uint64_t), string_sizes);
+            if (!header)
+                return;
+            header->userdata      = log_id;
+            char *writePos        = (char *)(header + 1);
+            *(uint64_t *)writePos = timestamp;
+            writePos += 8;
+            details::store_arguments(string_sizes, &writePos, args...);
+            sb->finish();
         }
-        header->userdata      = log_id;
-        char *writePos        = (char *)(header + 1);
-        *(uint64_t *)writePos = timestamp;
-        writePos += 8;
-        details::store_arguments(string_sizes, &writePos, args...);
-        finish();
+        if (!ready_.load(std::memory_order_relaxed))
+            mark_ready();
+        if (level == FATAL)
+            flush();
     }
 
     void set_log_file(const char *filename)
@@ -55,6 +70,37 @@ class stra_logger
         log_handler_.set_log_file(filename);
     }
 
+    void set_binary_log_file(const char *filename)
+    {
+        log_handler_.set_binary_log_file(filename);
+    }
+
+    // the logger owns sink afterwards
+    void set_log_sink(log_sink *sink)
+    {
+        log_handler_.set_log_sink(sink);
+    }
+
+    void set_binary_log_sink(log_sink *sink)
+    {
+        log_handler_.set_binary_log_sink(sink);
+    }
+
+    // sub-second digits and time zone of the line prefix, loggers in one
+    // stra_logger_group share the date string and should agree on utc
+    void set_time_format(time_precision precision, bool utc = false)
+    {
+        lock_poll();
+        log_handler_.set_time_format(precision, utc);
+        unlock_poll();
+    }
+
+    // takes effect if the staging buffer is not allocated yet
+    void set_staging_buffer_options(const staging_buffer_options &opts)
+    {
+        buffer_opts_ = opts;
+    }
+
     void set_log_level(log_level logLevel)
     {
         cur_level_ = logLevel;
@@ -64,46 +110,109 @@ class stra_logger
     {
         return cur_level_;
     }
-    void poll()
+    // false until the logging thread allocated its staging buffer
+    bool get_stats(staging_buffer_stats &stats)
+    {
+        staging_buffer *sb = staging_buffer_.load(std::memory_order_acquire);
+        if (sb == nullptr)
+            return false;
+        sb->get_stats(stats);
+        return true;
+    }
+
+    // let poll() write get_stats() to the log every interval_ns, 0 disables
+    void set_stats_interval(int64_t interval_ns)
+    {
+        stats_interval_tsc_ = static_cast<int64_t>(interval_ns * tscns_.getTscGhz());
+    }
+
+    // poll() recalibrates the shared TSCNS on its interval, see
+    // TSCNS::setCalibrateInterval. With enable every calibration done by
+    // this logger's poll is written to its log along with the drift.
+    void set_log_calibrations(bool enable)
+    {
+        log_calibrations_ = enable;
+    }
+
+    tscns_stats get_tsc_stats()
     {
+        tscns_stats stats;
+        tscns_.getStats(stats);
+        return stats;
+    }
+
+    // returns the number of messages handled
+    size_t poll()
+    {
+        lock_poll();
+        size_t cnt = poll_inner();
+        unlock_poll();
+        return cnt;
+    }
+
+    // writes everything logged so far and flushes the sink, FATAL logs call
+    // it before returning
+    void flush()
+    {
+        lock_poll();
         poll_inner();
+        log_handler_.flush();
+        unlock_poll();
     }
 
   private:
     /////////////////////////////////////////////////////////////////
-    void ensure_staging_buffer_allocated()
+    // only the logging thread stores, the release publishes the constructed
+    // buffer to the poller
+    staging_buffer *ensure_staging_buffer_allocated()
     {
-        if (staging_buffer_ == nullptr) {
-            staging_buffer_ = new staging_buffer();
+        staging_buffer *sb = staging_buffer_.load(std::memory_order_relaxed);
+        if (sb == nullptr) {
+            sb = new staging_buffer(buffer_opts_);
+            staging_buffer_.store(sb, std::memory_order_release);
         }
+        return sb;
     }
 
-    staging_buffer::queue_header *alloc(size_t size)
+    // the first log after a group round found the logger idle puts it on the
+    // group's ready list, see stra_logger_group
+    void mark_ready()
     {
-        if (staging_buffer_ == nullptr) {
-            ensure_staging_buffer_allocated();
-        }
-        return staging_buffer_->alloc(size);
+        if (ready_.exchange(true, std::memory_order_acq_rel))
+            return;
+        std::atomic<stra_logger *> *list = ready_list_.load(std::memory_order_acquire);
+        if (list == nullptr)
+            return;
+        stra_logger *head = list->load(std::memory_order_relaxed);
+        do {
+            next_ready_ = head;
+        } while (!list->compare_exchange_weak(head, this, std::memory_order_release, std::memory_order_relaxed));
     }
 
-    void finish()
+    // poller side, messages logged but not drained yet
+    bool has_pending()
     {
-        staging_buffer_->finish();
+        staging_buffer *sb = staging_buffer_.load(std::memory_order_acquire);
+        return sb && sb->front();
     }
 
   private:
     void register_log(static_log_info &info, int &log_id)
     {
+        char *p = static_cast<char *>(malloc(info.fragments_size()));
+        info.create_log_fragments(&p);
         std::lock_guard<std::mutex> lock(register_mutex);
-        if (log_id != UNASSIGNED_LOGID)
+        if (log_id != UNASSIGNED_LOGID) {
+            free(info.fragments);
             return;
-        char *p = static_cast<char *>(malloc(1024));
-        info.create_log_fragments(&p);
+        }
         log_id = static_cast<int32_t>(log_infos_.size()) + static_cast<int32_t>(log_handler_.get_log_infos_cnt());
         log_infos_.emplace_back(info);
     }
 
-    void poll_inner()
+    // drains at most max_msgs messages, 0 drains everything. A group
+    // calibrates the shared TSCNS once per round instead.
+    size_t poll_inner(size_t max_msgs = 0, bool calibrate = true)
     {
         if (log_infos_.size()) {
             std::unique_lock<std::mutex> lock(register_mutex);
@@ -113,27 +222,99 @@ class stra_logger
             log_infos_.clear();
         }
 
-        while (true) {
-            if (staging_buffer_ == nullptr) {
-                ensure_staging_buffer_allocated();
+        if (calibrate && tscns_.calibrate() && log_calibrations_) {
+            write_calibration();
+        }
+
+        size_t cnt = 0;
+        // the buffer belongs to the logging thread, it allocates it on its first log
+        staging_buffer *sb = staging_buffer_.load(std::memory_order_acquire);
+        if (sb == nullptr)
+            return 0;
+        sb->update_high_water();
+        if (stats_interval_tsc_) {
+            int64_t tsc = tscns_.rdtsc();
+            if (tsc >= next_stats_tsc_) {
+                next_stats_tsc_ = tsc + stats_interval_tsc_;
+                write_stats(sb);
             }
-            auto h = staging_buffer_->front();
-            if (h == nullptr || h->userdata >= log_handler_.get_log_infos_cnt())
+        }
+        while (true) {
+            auto h = sb->front();
+            if (h == nullptr || staging_buffer::log_id(h) >= log_handler_.get_log_infos_cnt())
+                break;
+            log_handler_.handle_log(sb->get_name(), h);
+            sb->pop(h);
+            if (++cnt == max_msgs)
                 break;
-            log_handler_.handle_log(staging_buffer_->get_name(), h);
-            staging_buffer_->pop();
         }
+        sb->release();
+        return cnt;
+    }
+
+    // the logger's own lock, or the group's while it belongs to a
+    // stra_logger_group, which may switch it while we spin
+    void lock_poll()
+    {
+        while (true) {
+            std::atomic<bool> *lock = poll_lock_ptr_.load(std::memory_order_acquire);
+            while (lock->exchange(true, std::memory_order_acquire)) {
+                details::cpu_relax();
+            }
+            if (lock == poll_lock_ptr_.load(std::memory_order_acquire)) {
+                held_lock_ = lock;
+                return;
+            }
+            lock->store(false, std::memory_order_release);
+        }
+    }
+    void unlock_poll()
+    {
+        held_lock_->store(false, std::memory_order_release);
+    }
+
+    void write_stats(staging_buffer *sb)
+    {
+        staging_buffer_stats stats;
+        sb->get_stats(stats);
+        char msg[256];
+        int  len = snprintf(msg, sizeof(msg), "staging buffer %s: msgs %lu bytes %lu dropped %lu high water %lu/%u", stats.name, stats.msgs, stats.bytes,
+                            stats.dropped, stats.high_water_bytes, stats.capacity);
+        log_handler_.write_text_log("stra_logger", stats.dropped ? WARN : INFO, tscns_.rdns(), msg, len);
+    }
+
+    void write_calibration()
+    {
+        tscns_stats stats;
+        tscns_.getStats(stats);
+        char msg[128];
+        int  len = snprintf(msg, sizeof(msg), "tsc calibration %lu: err %ldns max %ldns, %.9f ghz", stats.calibrations, stats.last_err_ns,
+                            stats.max_abs_err_ns, stats.tsc_ghz);
+        log_handler_.write_text_log("stra_logger", INFO, tscns_.rdns(), msg, len);
     }
 
   private:
     std::vector<static_log_info> log_infos_;
 
   private:
-    log_level       cur_level_{log_level::TRACE};
-    staging_buffer *staging_buffer_{nullptr};
-    std::mutex      register_mutex;
-    TSCNS          &tscns_;
-    log_handler     log_handler_;
+    log_level                                 cur_level_{log_level::TRACE};
+    staging_buffer_options                    buffer_opts_;
+    std::atomic<staging_buffer *>             staging_buffer_{nullptr};
+    int64_t                                   stats_interval_tsc_{0};
+    int64_t                                   next_stats_tsc_{0};
+    bool                                      log_calibrations_{false};
+    std::mutex                                register_mutex;
+    std::atomic<bool>                         poll_lock_{false};
+    std::atomic<std::atomic<bool> *>          poll_lock_ptr_{&poll_lock_};
+    std::atomic<bool>                        *held_lock_{nullptr};
+    // false while a stra_logger_group knows the logger is drained, always
+    // true outside a group
+    std::atomic<bool>                         ready_{true};
+    std::atomic<std::atomic<stra_logger *> *> ready_list_{nullptr};
+    stra_logger                              *next_ready_{nullptr};
+    size_t                                    group_slot_{0};
+    TSCNS                                    &tscns_;
+    log_handler                               log_handler_;
 };
 #define STRA_LOG(stra_logger, level, format, ...)                                                                                                    \
     do {                                                                                                                                             \
@@ -0,0 +1,234 @@
+#pragma once
+#include "log_handler.h"
+#include "stra_logger.h"
+#include "tscns.h"
+#include "utils.h"
+#include <algorithm>
+#include <atomic>
+#include <stdint.h>
+#include <vector>
+
+struct stra_logger_group_options
+{
+    // messages one logger may drain before the next one gets its turn, a
+    // busy strategy cannot hold back the others for longer. 0 is unlimited
+    uint32_t batch_msgs{256};
+    // flush the sinks written since the last flush in one pass at most this
+    // often, 0 leaves flushing to the sinks like a lone stra_logger does
+    int64_t  flush_interval_ns{0};
+    // every member is polled at least this often. A log racing with the
+    // round that found its logger idle can miss the ready list, the sweep
+    // picks it up. 0 disables
+    int64_t  sweep_interval_ns{100000000};
+};
+
+// Many stra_logger instances serviced by one poll() call, e.g. from one
+// backend_thread task. Members share the group's poll lock, so their
+// handlers can share one time string cache. A round only polls the
+// members with work: a logger found drained leaves the active set, and
+// its next log pushes it onto the group's ready list.
+class stra_logger_group
+{
+  public:
+    stra_logger_group(TSCNS &tscns, const stra_logger_group_options &opts = stra_logger_group_options()) : tscns_(tscns), opts_(opts)
+    {
+        flush_interval_tsc_ = static_cast<int64_t>(opts_.flush_interval_ns * tscns_.getTscGhz());
+        sweep_interval_tsc_ = static_cast<int64_t>(opts_.sweep_interval_ns * tscns_.getTscGhz());
+    }
+    // the loggers stay alive and go back to polling on their own
+    ~stra_logger_group()
+    {
+        lock_poll();
+        for (auto &m : members_) {
+            m.logger->log_handler_.flush();
+            detach(m.logger);
+        }
+        members_.clear();
+        unlock_poll();
+    }
+    stra_logger_group(const stra_logger_group &)            = delete;
+    stra_logger_group &operator=(const stra_logger_group &) = delete;
+
+    void add(stra_logger *logger)
+    {
+        // hold the logger's own lock, a poll() or FATAL flush on it may be
+        // in progress
+        logger->lock_poll();
+        lock_poll();
+        logger->log_handler_.share_time_cache(&time_);
+        logger->poll_lock_ptr_.store(&poll_lock_, std::memory_order_release);
+        logger->group_slot_ = members_.size();
+        members_.push_back(member{logger, false});
+        // the next round polls it and takes it off the active set once drained
+        logger->ready_.store(true, std::memory_order_relaxed);
+        logger->ready_list_.store(&ready_head_, std::memory_order_release);
+        active_.push_back(logger);
+        unlock_poll();
+        logger->unlock_poll();
+    }
+
+    // drains and flushes the logger, which can be deleted afterwards
+    void remove(stra_logger *logger)
+    {
+        lock_poll();
+        for (size_t i = 0; i < members_.size(); i++) {
+            if (members_[i].logger != logger)
+                continue;
+            logger->poll_inner();
+            logger->log_handler_.flush();
+            detach(logger);
+            members_.erase(members_.begin() + i);
+            for (size_t j = i; j < members_.size(); j++) {
+                members_[j].logger->group_slot_ = j;
+            }
+            take_ready();
+            active_.erase(std::remove(active_.begin(), active_.end(), logger), active_.end());
+            break;
+        }
+        unlock_poll();
+    }
+
+    size_t size()
+    {
+        return members_.size();
+    }
+
+    // one round over every logger, returns the number of messages handled
+    size_t poll()
+    {
+        lock_poll();
+        size_t cnt = poll_round();
+        if (flush_interval_tsc_ && dirty_) {
+            int64_t tsc = tscns_.rdtsc();
+            if (tsc >= next_flush_tsc_) {
+                next_flush_tsc_ = tsc + flush_interval_tsc_;
+                flush_dirty();
+            }
+        }
+        unlock_poll();
+        return cnt;
+    }
+
+    // writes everything logged so far by every logger and flushes their sinks
+    void flush()
+    {
+        lock_poll();
+        for (auto &m : members_) {
+            m.logger->poll_inner();
+            m.logger->log_handler_.flush();
+            m.dirty = false;
+        }
+        dirty_ = false;
+        unlock_poll();
+    }
+
+  private:
+    struct member
+    {
+        stra_logger *logger;
+        // written since the last flush
+        bool         dirty;
+    };
+
+    size_t poll_round()
+    {
+        if (tscns_.calibrate()) {
+            for (auto &m : members_) {
+                if (m.logger->log_calibrations_)
+                    m.logger->write_calibration();
+            }
+        }
+        take_ready();
+        if (sweep_interval_tsc_) {
+            int64_t tsc = tscns_.rdtsc();
+            if (tsc >= next_sweep_tsc_) {
+                next_sweep_tsc_ = tsc + sweep_interval_tsc_;
+                for (auto &m : members_) {
+                    if (!m.logger->ready_.exchange(true, std::memory_order_acq_rel))
+                        active_.push_back(m.logger);
+                }
+            }
+        }
+        size_t cnt = 0;
+        polling_.swap(active_);
+        for (auto logger : polling_) {
+            size_t c = logger->poll_inner(opts_.batch_msgs, false);
+            if (c) {
+                cnt += c;
+                members_[logger->group_slot_].dirty = true;
+                dirty_                              = true;
+            }
+            // a full batch may have left messages, stats are written by polls
+            if ((opts_.batch_msgs && c == opts_.batch_msgs) || logger->stats_interval_tsc_) {
+                active_.push_back(logger);
+                continue;
+            }
+            // drained, from here on a log marks it again. Look once more for
+            // a log that saw ready_ still set, unless that log's mark won.
+            logger->ready_.store(false, std::memory_order_seq_cst);
+            if (logger->has_pending() && !logger->ready_.exchange(true, std::memory_order_acq_rel))
+                active_.push_back(logger);
+        }
+        polling_.clear();
+        return cnt;
+    }
+
+    // moves the loggers pushed by mark_ready into the active set
+    void take_ready()
+    {
+        stra_logger *logger = ready_head_.exchange(nullptr, std::memory_order_acquire);
+        while (logger) {
+            stra_logger *next = logger->next_ready_;
+            // pushed by a log racing with remove()
+            if (logger->ready_list_.load(std::memory_order_relaxed) == &ready_head_)
+                active_.push_back(logger);
+            logger = next;
+        }
+    }
+
+    void flush_dirty()
+    {
+        for (auto &m : members_) {
+            if (m.dirty) {
+                m.logger->log_handler_.flush();
+                m.dirty = false;
+            }
+        }
+        dirty_ = false;
+    }
+
+    void detach(stra_logger *logger)
+    {
+        logger->ready_list_.store(nullptr, std::memory_order_release);
+        logger->ready_.store(true, std::memory_order_relaxed);
+        logger->log_handler_.share_time_cache(nullptr);
+        logger->poll_lock_ptr_.store(&logger->poll_lock_, std::memory_order_release);
+    }
+
+    void lock_poll()
+    {
+        while (poll_lock_.exchange(true, std::memory_order_acquire)) {
+            details::cpu_relax();
+        }
+    }
+    void unlock_poll()
+    {
+        poll_lock_.store(false, std::memory_order_release);
+    }
+
+  private:
+    TSCNS                     &tscns_;
+    stra_logger_group_options  opts_;
+    int64_t                    flush_interval_tsc_{0};
+    int64_t                    next_flush_tsc_{0};
+    int64_t                    sweep_interval_tsc_{0};
+    int64_t                    next_sweep_tsc_{0};
+    std::vector<member>        members_;
+    // members to poll in the next round, and the ones being polled
+    std::vector<stra_logger *> active_;
+    std::vector<stra_logger *> polling_;
+    std::atomic<stra_logger *> ready_head_{nullptr};
+    bool                       dirty_{false};
+    time_cache                 time_;
+    std::atomic<bool>          poll_lock_{false};
+};
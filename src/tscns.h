@@ -4,12 +4,22 @@
 #pragma once
 #include <atomic>
 #include <chrono>
+#include <mutex>
+#include <stdio.h>
 #include <thread>
 
 #ifdef _MSC_VER
 #include <intrin.h>
 #endif
 
+struct tscns_stats
+{
+    uint64_t calibrations;
+    int64_t  last_err_ns;
+    int64_t  max_abs_err_ns;
+    double   tsc_ghz;
+};
+
 class TSCNS
 {
   public:
@@ -17,7 +27,7 @@ class TSCNS
 
     void init(int64_t init_calibrate_ns = 20000000, int64_t calibrate_interval_ns = 3 * NsPerSec)
     {
-        calibate_interval_ns_ = calibrate_interval_ns;
+        calibate_interval_ns_.store(calibrate_interval_ns, std::memory_order_relaxed);
         int64_t base_tsc, base_ns;
         syncTime(base_tsc, base_ns);
         int64_t expire_ns = base_ns + init_calibrate_ns;
@@ -29,17 +39,149 @@ class TSCNS
         saveParam(base_tsc, base_ns, base_ns, init_ns_per_tsc);
     }
 
-    void calibrate()
+    // the process wide clock, shared by fast_logger and stra_loggers built
+    // without a TSCNS of their own
+    static TSCNS &global()
+    {
+        static TSCNS tscns;
+        return tscns;
+    }
+
+    // init on the first call only, later calls return once it is done
+    void initOnce(int64_t init_calibrate_ns = 20000000, int64_t calibrate_interval_ns = 3 * NsPerSec)
+    {
+        std::call_once(init_once_, [&] { init(init_calibrate_ns, calibrate_interval_ns); });
+    }
+
+    // initOnce starting from the ns_per_tsc saved in file by an earlier run,
+    // if it is younger than max_age_ns and agrees with a short check_ns
+    // measurement. calibrate() refines it from there. Otherwise it runs the
+    // full init and saves the result. Returns true when the file was used.
+    bool initOnceFromFile(const char *file, int64_t max_age_ns = 24 * 3600 * NsPerSec, int64_t check_ns = 1000000,
+                          int64_t calibrate_interval_ns = 3 * NsPerSec)
+    {
+        bool reused = false;
+        std::call_once(init_once_, [&] {
+            calibate_interval_ns_.store(calibrate_interval_ns, std::memory_order_relaxed);
+            double saved_ns_per_tsc;
+            if (loadParam(file, max_age_ns, saved_ns_per_tsc)) {
+                int64_t base_tsc, base_ns;
+                syncTime(base_tsc, base_ns);
+                int64_t expire_ns = base_ns + check_ns;
+                while (rdsysns() < expire_ns)
+                    std::this_thread::yield();
+                int64_t delayed_tsc, delayed_ns;
+                syncTime(delayed_tsc, delayed_ns);
+                double measured = (double)(delayed_ns - base_ns) / (delayed_tsc - base_tsc);
+                // a short window is noisy, only catch a different machine or a
+                // changed tsc frequency
+                double diff = measured - saved_ns_per_tsc;
+                if (diff < saved_ns_per_tsc * 1e-3 && -diff < saved_ns_per_tsc * 1e-3) {
+                    saveParam(delayed_tsc, delayed_ns, delayed_ns, saved_ns_per_tsc);
+                    reused = true;
+                    return;
+                }
+            }
+            init(20000000, calibrate_interval_ns);
+            saveCalibration(file);
+        });
+        return reused;
+    }
+
+    // writes the current ns_per_tsc, e.g. at shutdown once calibrate() has
+    // refined it, for initOnceFromFile of the next run
+    bool saveCalibration(const char *file) const
+    {
+        char tmp[4096];
+        if (snprintf(tmp, sizeof(tmp), "%s.tmp", file) >= (int)sizeof(tmp))
+            return false;
+        FILE *fp = fopen(tmp, "w");
+        if (!fp)
+            return false;
+        int64_t  base_tsc, base_ns;
+        double   ns_per_tsc;
+        uint32_t seq;
+        getParams(base_tsc, base_ns, ns_per_tsc, seq);
+        bool ok = fprintf(fp, "%.17g %ld\n", ns_per_tsc, (long)rdsysns()) > 0;
+        ok      = fclose(fp) == 0 && ok;
+        return ok && rename(tmp, file) == 0;
+    }
+
+    // called periodically by the pollers, returns true when it recalibrated.
+    // Pollers of different loggers may share one TSCNS, only one of them
+    // gets to write the params.
+    bool calibrate()
     {
-        if (rdtsc() < next_calibrate_tsc_)
-            return;
+        if (rdtsc() < next_calibrate_tsc_.load(std::memory_order_relaxed))
+            return false;
+        if (calibrating_.exchange(true, std::memory_order_acquire))
+            return false;
+        int64_t interval_ns = calibate_interval_ns_.load(std::memory_order_relaxed);
+        if (interval_ns == 0 || rdtsc() < next_calibrate_tsc_.load(std::memory_order_relaxed)) {
+            calibrating_.store(false, std::memory_order_release);
+            return false;
+        }
         int64_t tsc, ns;
         syncTime(tsc, ns);
         int64_t calulated_ns                     = tsc2ns(tsc);
         int64_t ns_err                           = calulated_ns - ns;
-        int64_t expected_err_at_next_calibration = ns_err + (ns_err - base_ns_err_) * calibate_interval_ns_ / (ns - base_ns_ + base_ns_err_);
-        double  new_ns_per_tsc                   = ns_per_tsc_ * (1.0 - (double)expected_err_at_next_calibration / calibate_interval_ns_);
+        int64_t expected_err_at_next_calibration = ns_err + (ns_err - base_ns_err_) * interval_ns / (ns - base_ns_ + base_ns_err_);
+        double  new_ns_per_tsc                   = ns_per_tsc_ * (1.0 - (double)expected_err_at_next_calibration / interval_ns);
         saveParam(tsc, calulated_ns, ns, new_ns_per_tsc);
+        int64_t abs_err = ns_err < 0 ? -ns_err : ns_err;
+        calibrations_.fetch_add(1, std::memory_order_relaxed);
+        last_err_ns_.store(ns_err, std::memory_order_relaxed);
+        if (abs_err > max_abs_err_ns_.load(std::memory_order_relaxed))
+            max_abs_err_ns_.store(abs_err, std::memory_order_relaxed);
+        calibrating_.store(false, std::memory_order_release);
+        return true;
+    }
+
+    // 0 stops calibrate() from doing anything, the pollers pick the new
+    // interval up with their next calibrate()
+    void setCalibrateInterval(int64_t calibrate_interval_ns)
+    {
+        calibate_interval_ns_.store(calibrate_interval_ns, std::memory_order_relaxed);
+        // calibrate() may be saving new params on a poller right now
+        int64_t  base_tsc, base_ns;
+        double   ns_per_tsc;
+        uint32_t seq;
+        getParams(base_tsc, base_ns, ns_per_tsc, seq);
+        next_calibrate_tsc_.store(calibrate_interval_ns ? base_tsc + (int64_t)((calibrate_interval_ns - 1000) / ns_per_tsc) : INT64_MAX,
+                                  std::memory_order_relaxed);
+    }
+
+    // the params tsc2ns uses and the seq they were published with, read
+    // consistently with calibrate() running on another thread
+    void getParams(int64_t &base_tsc, int64_t &base_ns, double &ns_per_tsc, uint32_t &seq) const
+    {
+        while (true) {
+            seq = param_seq_.load(std::memory_order_acquire) & ~1u;
+            std::atomic_signal_fence(std::memory_order_acq_rel);
+            base_tsc   = base_tsc_;
+            base_ns    = base_ns_;
+            ns_per_tsc = ns_per_tsc_;
+            std::atomic_signal_fence(std::memory_order_acq_rel);
+            if (seq == param_seq_.load(std::memory_order_acquire))
+                return;
+        }
+    }
+
+    // installs params recorded elsewhere, e.g. by the binary log
+    // decompressor replaying the ones getParams returned at write time
+    void setParams(int64_t base_tsc, int64_t base_ns, double ns_per_tsc)
+    {
+        saveParam(base_tsc, base_ns, base_ns, ns_per_tsc);
+    }
+
+    // drift observed by calibrate(): tsc2ns minus the system clock right
+    // before each calibration
+    void getStats(tscns_stats &stats) const
+    {
+        stats.calibrations   = calibrations_.load(std::memory_order_relaxed);
+        stats.last_err_ns    = last_err_ns_.load(std::memory_order_relaxed);
+        stats.max_abs_err_ns = max_abs_err_ns_.load(std::memory_order_relaxed);
+        stats.tsc_ghz        = getTscGhz();
     }
 
     static inline int64_t rdtsc()
@@ -79,7 +221,11 @@ class TSCNS
 
     double getTscGhz() const
     {
-        return 1.0 / ns_per_tsc_;
+        int64_t  base_tsc, base_ns;
+        double   ns_per_tsc;
+        uint32_t seq;
+        getParams(base_tsc, base_ns, ns_per_tsc, seq);
+        return 1.0 / ns_per_tsc;
     }
 
     // Linux kernel sync time by finding the first trial with tsc diff < 50000
@@ -124,11 +270,24 @@ class TSCNS
         ns_out  = ns[best];
     }
 
+  private:
+    static bool loadParam(const char *file, int64_t max_age_ns, double &ns_per_tsc)
+    {
+        FILE *fp = fopen(file, "r");
+        if (!fp)
+            return false;
+        long saved_ns = 0;
+        bool ok       = fscanf(fp, "%lf %ld", &ns_per_tsc, &saved_ns) == 2;
+        fclose(fp);
+        return ok && ns_per_tsc > 0 && rdsysns() - saved_ns < max_age_ns;
+    }
+
     void saveParam(int64_t base_tsc, int64_t base_ns, int64_t sys_ns, double new_ns_per_tsc)
     {
         base_ns_err_        = base_ns - sys_ns;
-        next_calibrate_tsc_ = base_tsc + (int64_t)((calibate_interval_ns_ - 1000) / new_ns_per_tsc);
-        uint32_t seq        = param_seq_.load(std::memory_order_relaxed);
+        int64_t interval_ns = calibate_interval_ns_.load(std::memory_order_relaxed);
+        next_calibrate_tsc_.store(interval_ns ? base_tsc + (int64_t)((interval_ns - 1000) / new_ns_per_tsc) : INT64_MAX, std::memory_order_relaxed);
+        uint32_t seq = param_seq_.load(std::memory_order_relaxed);
         param_seq_.store(++seq, std::memory_order_release);
         std::atomic_signal_fence(std::memory_order_acq_rel);
         base_tsc_   = base_tsc;
@@ -142,7 +301,14 @@ class TSCNS
     double  ns_per_tsc_;
     int64_t base_tsc_;
     int64_t base_ns_;
-    int64_t calibate_interval_ns_;
     int64_t base_ns_err_;
-    int64_t next_calibrate_tsc_;
+    // set by setCalibrateInterval, read by the pollers in calibrate()
+    std::atomic<int64_t> calibate_interval_ns_{0};
+    std::atomic<int64_t> next_calibrate_tsc_{0};
+
+    std::once_flag        init_once_;
+    std::atomic<bool>     calibrating_{false};
+    std::atomic<uint64_t> calibrations_{0};
+    std::atomic<int64_t>  last_err_ns_{0};
+    std::atomic<int64_t>  max_abs_err_ns_{0};
 };
\ No newline at end of file
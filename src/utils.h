@@ -1,6 +1,9 @@
 #pragma once
+#include "formatter.h"
+#include <algorithm>
 #include <limits>
 #include <stddef.h>
+#include <stdexcept>
 #include <stdint.h>
 #include <string.h>
 #include <type_traits>
@@ -48,6 +51,18 @@ static void FASTLOG_PRINTF_FORMAT_ATTR(1, 2) check_format(const char *, ...)
 {
 }
 
+/**
+ * Hint to the cpu that we are in a spin-wait loop.
+ */
+inline void cpu_relax()
+{
+#if defined(__i386__) || defined(__x86_64__) || defined(__amd64__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__)
+    asm volatile("yield" ::: "memory");
+#endif
+}
+
 constexpr inline bool is_terminal(char c)
 {
     return c == 'd' || c == 'i' || c == 'u' || c == 'o' || c == 'x' || c == 'X' || c == 'f' || c == 'F' || c == 'e' || c == 'E' || c == 'g' ||
@@ -97,6 +112,91 @@ constexpr inline bool is_digit(char c)
     return (c >= '0' && c <= '9');
 }
 
+/**
+ * One parsed printf conversion, i.e.
+ * %<flags><width>.<precision><length><specifier>
+ */
+struct format_conversion
+{
+    // characters consumed including the '%', 0 if fmt is not a conversion
+    int         length;
+    format_spec spec;
+    bool        dynamic_width;
+    bool        dynamic_precision;
+    char        length_modifier[3];
+};
+
+/**
+ * Parses the conversion starting at the '%' fmt points to. Width and
+ * precision are -1 when absent or dynamic, "%%" is not a conversion.
+ */
+constexpr inline format_conversion parse_conversion(const char *fmt)
+{
+    format_conversion conv{0, format_spec{0, 0, -1, -1}, false, false, {0, 0, 0}};
+    int               pos = 1;
+    while (is_flag(fmt[pos])) {
+        switch (fmt[pos]) {
+            case '-':
+                conv.spec.flags |= FLAG_MINUS;
+                break;
+            case '+':
+                conv.spec.flags |= FLAG_PLUS;
+                break;
+            case ' ':
+                conv.spec.flags |= FLAG_SPACE;
+                break;
+            case '#':
+                conv.spec.flags |= FLAG_HASH;
+                break;
+            default:
+                conv.spec.flags |= FLAG_ZERO;
+                break;
+        }
+        ++pos;
+    }
+
+    if (fmt[pos] == '*') {
+        conv.dynamic_width = true;
+        ++pos;
+    } else if (is_digit(fmt[pos])) {
+        conv.spec.width = 0;
+        while (is_digit(fmt[pos])) {
+            conv.spec.width = 10 * conv.spec.width + (fmt[pos] - '0');
+            ++pos;
+        }
+    }
+
+    if (fmt[pos] == '.') {
+        ++pos;
+        if (fmt[pos] == '*') {
+            conv.dynamic_precision = true;
+            ++pos;
+        } else {
+            // a lone '.' means a precision of 0
+            conv.spec.precision = 0;
+            while (is_digit(fmt[pos])) {
+                conv.spec.precision = 10 * conv.spec.precision + (fmt[pos] - '0');
+                ++pos;
+            }
+        }
+    }
+
+    // hh, h, ll, l, j, z, Z, t, L
+    if ((fmt[pos] == 'h' || fmt[pos] == 'l') && fmt[pos + 1] == fmt[pos]) {
+        conv.length_modifier[0] = conv.length_modifier[1] = fmt[pos];
+        pos += 2;
+    } else if (is_length(fmt[pos]) || fmt[pos] == 'Z') {
+        conv.length_modifier[0] = fmt[pos];
+        ++pos;
+    }
+
+    if (fmt[pos] == '%' || !is_terminal(fmt[pos]))
+        return conv;
+    conv.spec.specifier = fmt[pos];
+    conv.length         = pos + 1;
+    return conv;
+}
+
 template <int N>
 constexpr inline param_type get_param_Info(const char (&fmt)[N], int paramNum = 0)
 {
@@ -122,74 +222,44 @@ constexpr inline param_type get_param_Info(const char (&fmt)[N], int paramNum =
                 ++pos;
                 continue;
             } else {
-                // Consume flags
-                while (is_flag(fmt[pos]))
-                    ++pos;
-
-                // Consume width
-                if (fmt[pos] == '*') {
-                    if (paramNum == 0)
-                        return param_type::DYNAMIC_WIDTH;
-
-                    --paramNum;
-                    ++pos;
-                } else {
-                    while (is_digit(fmt[pos]))
-                        ++pos;
-                }
-
-                // Consume precision
-                bool hasDynamicPrecision = false;
-                int  precision           = -1;
-                if (fmt[pos] == '.') {
-                    ++pos; // consume '.'
-
-                    if (fmt[pos] == '*') {
-                        if (paramNum == 0)
-                            return param_type::DYNAMIC_PRECISION;
-
-                        hasDynamicPrecision = true;
-                        --paramNum;
-                        ++pos;
-                    } else {
-                        precision = 0;
-                        while (is_digit(fmt[pos])) {
-                            precision = 10 * precision + (fmt[pos] - '0');
-                            ++pos;
-                        }
-                    }
-                }
-
-                // consume length
-                while (is_length(fmt[pos]))
-                    ++pos;
-
-                // Consume terminal
-                if (!is_terminal(fmt[pos])) {
+                format_conversion conv = parse_conversion(fmt + pos - 1);
+                if (conv.length == 0) {
                     throw std::invalid_argument("Unrecognized format specifier after %");
                 }
 
                 // Fail on %n specifiers (i.e. store position to address) since
                 // we cannot know the position without formatting.
-                if (fmt[pos] == 'n') {
+                if (conv.spec.specifier == 'n') {
                     throw std::invalid_argument("%n specifiers are not support in NanoLog!");
                 }
 
+                if (conv.dynamic_width) {
+                    if (paramNum == 0)
+                        return param_type::DYNAMIC_WIDTH;
+                    --paramNum;
+                }
+
+                if (conv.dynamic_precision) {
+                    if (paramNum == 0)
+                        return param_type::DYNAMIC_PRECISION;
+                    --paramNum;
+                }
+
                 if (paramNum != 0) {
                     --paramNum;
-                    ++pos;
+                    pos += conv.length - 1;
                     continue;
                 } else {
-                    if (fmt[pos] != 's')
+                    if (conv.spec.specifier != 's')
                         return param_type::NON_STRING;
 
-                    if (hasDynamicPrecision)
+                    if (conv.dynamic_precision)
                         return param_type::STRING_WITH_DYNAMIC_PRECISION;
 
-                    if (precision == -1)
+                    if (conv.spec.precision == -1)
                         return param_type::STRING_WITH_NO_PRECISION;
                     else
-                        return param_type(precision);
+                        return param_type(conv.spec.precision);
                 }
             }
         }
@@ -208,55 +278,133 @@ constexpr inline int count_fmt_params(const char (&fmt)[N])
 }
 
 template <typename T>
-inline
-typename std::enable_if<!std::is_same<T, const wchar_t *>::value && !std::is_same<T, const char *>::value && !std::is_same<T, wchar_t *>::value &&
-                        !std::is_same<T, char *>::value && !std::is_same<T, const void *>::value && !std::is_same<T, void *>::value,
-                        size_t>::type
-get_arg_size(size_t &stringSize, T arg)
+struct is_string_arg : std::integral_constant<bool, std::is_same<T, const char *>::value || std::is_same<T, char *>::value>
 {
-    return sizeof(T) + sizeof(uint32_t);
-}
+};
+
+// arg_layout::sizes entries: the size of a fixed size argument, 0 for a
+// string, plus how a compact record stores it, see store_compact_arguments
+static constexpr uint8_t ARG_SIZE_MASK    = 0x3f;
+// an integer written as a varint
+static constexpr uint8_t ARG_VARINT       = 0x40;
+// a signed one, zigzag encoded first
+static constexpr uint8_t ARG_SIGNED       = 0x80;
+// bytes of a varint of a 64 bit value
+static constexpr size_t  MAX_VARINT_BYTES = 10;
+
+// printf's default argument promotions: an argument is stored the way a
+// variadic call would pass it, so %c takes a char and %f a float
+template <typename T>
+using promoted_arg = typename std::conditional<
+    std::is_integral<T>::value && sizeof(T) < sizeof(int), int, typename std::conditional<std::is_same<T, float>::value, double, T>::type>::type;
 
-inline size_t get_arg_size(size_t &stringSize, const void *)
+template <typename T>
+constexpr uint8_t arg_kind()
 {
-    return sizeof(void *) + sizeof(uint32_t);
+    using P = promoted_arg<T>;
+    if constexpr (is_string_arg<T>::value) {
+        return 0;
+    } else if constexpr (std::is_integral<P>::value) {
+        return static_cast<uint8_t>(sizeof(P) | ARG_VARINT | (std::is_signed<P>::value ? ARG_SIGNED : 0));
+    } else {
+        return static_cast<uint8_t>(sizeof(P));
+    }
 }
 
-inline size_t get_arg_size(size_t &stringBytes, const char *str)
+// bytes of an argument in a compact record at most, a string's length is a
+// varint of a 32 bit value
+template <typename T>
+constexpr size_t compact_arg_max_size()
 {
-    stringBytes = strlen(str);
-    return stringBytes + sizeof(uint32_t);
+    constexpr uint8_t kind = arg_kind<T>();
+    if constexpr (kind == 0) {
+        return 5;
+    } else if constexpr (kind & ARG_VARINT) {
+        return (sizeof(promoted_arg<T>) * 8 + 6) / 7;
+    } else {
+        return sizeof(promoted_arg<T>);
+    }
 }
+
+// Record layout of the arguments, known at compile time: a fixed size
+// argument is stored as the raw bytes of its promoted_arg, a string as a 4 byte length and the
+// characters. The consumer walks the record with sizes, which registration
+// stores in static_log_info. A compact record stores integers and string
+// lengths as varints instead, see store_compact_arguments.
+template <typename... Ts>
+struct arg_layout
+{
+    static constexpr bool    has_strings      = (is_string_arg<Ts>::value || ... || false);
+    // the whole argument block when there are no strings
+    static constexpr size_t  fixed_size       = ((is_string_arg<Ts>::value ? sizeof(uint32_t) : sizeof(promoted_arg<Ts>)) + ... + 0);
+    // the same for a compact record at most
+    static constexpr size_t  compact_max_size = (compact_arg_max_size<Ts>() + ... + 0);
+    // per argument its arg_kind
+    static constexpr uint8_t sizes[sizeof...(Ts) + 1] = {arg_kind<Ts>()..., 0};
+};
+
+// only for decltype, the layout of the arguments as log() receives them
+template <typename... Ts>
+arg_layout<Ts...> make_arg_layout(Ts...);
+
 template <int argNum = 0, int M>
-inline size_t get_arg_sizes(size_t (&)[M])
+inline size_t get_string_sizes(size_t (&)[M])
 {
     return 0;
 }
 template <int argNum = 0, int M, typename T1, typename... Ts>
-inline size_t get_arg_sizes(size_t (&stringSizes)[M], T1 head, Ts... rest)
+inline size_t get_string_sizes(size_t (&stringSizes)[M], T1 head, Ts... rest)
 {
-    return get_arg_size(stringSizes[argNum], head) + get_arg_sizes<argNum + 1>(stringSizes, rest...);
+    size_t size = 0;
+    if constexpr (is_string_arg<T1>::value) {
+        size = stringSizes[argNum] = strlen(head);
+    }
+    return size + get_string_sizes<argNum + 1>(stringSizes, rest...);
 }
 
-template <typename T>
-inline typename std::enable_if<!std::is_same<T, const wchar_t *>::value && !std::is_same<T, const char *>::value &&
-                               !std::is_same<T, wchar_t *>::value && !std::is_same<T, char *>::value,
-                               void>::type
-store_argument(char **storage, T arg, size_t stringSize)
+// bytes of the argument block, a constant unless there are strings
+template <int M, typename... Ts>
+inline size_t get_arg_sizes(size_t (&stringSizes)[M], Ts... args)
 {
-    auto size = sizeof(T);
-    memcpy(*storage, &size, sizeof(uint32_t));
-    *storage += sizeof(uint32_t);
+    if constexpr (arg_layout<Ts...>::has_strings) {
+        return arg_layout<Ts...>::fixed_size + get_string_sizes(stringSizes, args...);
+    } else {
+        return arg_layout<Ts...>::fixed_size;
+    }
+}
 
-    memcpy(*storage, &arg, sizeof(T));
-    *storage += sizeof(T);
-    return;
+// shortens the longest strings until excess bytes are saved or nothing is
+// left to cut, returns the bytes saved
+template <int M>
+inline size_t truncate_strings(size_t (&stringSizes)[M], size_t excess)
+{
+    size_t saved = 0;
+    while (saved < excess) {
+        int longest = 0;
+        for (int i = 1; i < M; i++) {
+            if (stringSizes[i] > stringSizes[longest])
+                longest = i;
+        }
+        if (stringSizes[longest] == 0)
+            break;
+        size_t cut = std::min(stringSizes[longest], excess - saved);
+        stringSizes[longest] -= cut;
+        saved += cut;
+    }
+    return saved;
+}
+
+template <typename T>
+inline typename std::enable_if<!is_string_arg<T>::value, void>::type store_argument(char **storage, T arg, size_t)
+{
+    promoted_arg<T> value = arg;
+    memcpy(*storage, &value, sizeof(value));
+    *storage += sizeof(value);
 }
 
 // string specialization of the above
 template <typename T>
-inline typename std::enable_if<std::is_same<T, const char *>::value || std::is_same<T, char *>::value, void>::type
-store_argument(char **storage, T arg, const size_t stringSize)
+inline typename std::enable_if<is_string_arg<T>::value, void>::type store_argument(char **storage, T arg, const size_t stringSize)
 {
     if (stringSize > std::numeric_limits<uint32_t>::max()) {
         throw std::invalid_argument("Strings larger than std::numeric_limits<uint32_t>::max() are unsupported");
@@ -267,7 +415,6 @@ store_argument(char **storage, T arg, const size_t stringSize)
 
     memcpy(*storage, arg, stringSize);
     *storage += stringSize;
-    return;
 }
 
 template <int argNum = 0, int M>
@@ -281,4 +428,68 @@ inline void store_arguments(size_t (&stringBytes)[M], char **storage, T1 head, T
     store_argument(storage, head, stringBytes[argNum]);
     store_arguments<argNum + 1>(stringBytes, storage, rest...);
 }
-} // namespace details
\ No newline at end of file
+inline char *write_varint(char *p, uint64_t v)
+{
+    while (v >= 0x80) {
+        *p++ = static_cast<char>(v | 0x80);
+        v >>= 7;
+    }
+    *p++ = static_cast<char>(v);
+    return p;
+}
+
+inline uint64_t read_varint(const char *&p)
+{
+    uint64_t v = 0;
+    for (int shift = 0; shift < 64; shift += 7) {
+        uint8_t b = static_cast<uint8_t>(*p++);
+        v |= static_cast<uint64_t>(b & 0x7f) << shift;
+        if (!(b & 0x80))
+            break;
+    }
+    return v;
+}
+
+// small magnitudes of either sign get short varints
+inline uint64_t zigzag(int64_t v)
+{
+    return (static_cast<uint64_t>(v) << 1) ^ static_cast<uint64_t>(v >> 63);
+}
+
+inline int64_t unzigzag(uint64_t v)
+{
+    return static_cast<int64_t>(v >> 1) ^ -static_cast<int64_t>(v & 1);
+}
+
+// the compact counterpart of store_argument: integers of ARG_VARINT as
+// varints, string lengths as varints, everything else as raw bytes
+template <typename T>
+inline void store_compact_argument(char **storage, T arg, size_t stringSize)
+{
+    constexpr uint8_t kind = arg_kind<T>();
+    if constexpr (kind == 0) {
+        *storage = write_varint(*storage, stringSize);
+        memcpy(*storage, arg, stringSize);
+        *storage += stringSize;
+    } else if constexpr (kind & ARG_SIGNED) {
+        *storage = write_varint(*storage, zigzag(static_cast<int64_t>(arg)));
+    } else if constexpr (kind & ARG_VARINT) {
+        *storage = write_varint(*storage, static_cast<uint64_t>(arg));
+    } else {
+        promoted_arg<T> value = arg;
+        memcpy(*storage, &value, sizeof(value));
+        *storage += sizeof(value);
+    }
+}
+
+template <int argNum = 0, int M>
+inline void store_compact_arguments(size_t (&)[M], char **)
+{
+}
+template <int argNum = 0, int M, typename T1, typename... Ts>
+inline void store_compact_arguments(size_t (&stringSizes)[M], char **storage, T1 head, Ts... rest)
+{
+    store_compact_argument(storage, head, stringSizes[argNum]);
+    store_compact_arguments<argNum + 1>(stringSizes, storage, rest...);
+}
+} // namespace details
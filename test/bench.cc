@@ -0,0 +1,337 @@
+#include "fast_logger.h"
+#include "stra_logger_group.h"
+#include <algorithm>
+#include <atomic>
+#include <functional>
+#include <future>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <thread>
+#include <vector>
+
+// latency: per-message FAST_LOG latency seen by the producers, for each
+// staging buffer allocation mode and with compact records. Run on a
+// multi-socket box with threads spread over the nodes to see the effect of
+// numa_local.
+// drain: poller throughput with a few active producers among many idle ones,
+// and the cost of a poll finding nothing, for both drain orders.
+// format: text throughput with 0 to 4 format workers, and the poller's CPU
+// time per message, the part that does not scale with cores.
+// group: a round over many stra_logger instances, one poll task per logger
+// against one stra_logger_group, with one message per logger, per 10th
+// logger and none.
+// spsc: one producer and one consumer thread on a bare SPSCVarQueueOPT,
+// producer cost per message with one release store per message or per
+// batch, and the consumer updating read_idx per message or per run. Run it
+// under perf stat -e cache-misses, or perf c2c, for the cross-core traffic.
+// startup: constructing stra_loggers on the process wide clock, and a
+// TSCNS initialized from a saved calibration.
+// usage: bench latency [threads] [msgs per thread]
+//        bench drain [msgs per active thread]
+//        bench format [msgs per thread]
+//        bench group [loggers]
+//        bench spsc [msgs]
+//        bench startup [loggers]
+
+class null_sink : public log_sink
+{
+  public:
+    void append(const char *, const size_t) override
+    {
+    }
+    void flush() override
+    {
+    }
+};
+
+static void run_latency(const char *name, const staging_buffer_options &opts, int thread_cnt, int msg_cnt)
+{
+    fast_logger &logger = fast_logger::get_logger();
+    logger.set_staging_buffer_options(opts);
+    std::vector<std::vector<uint32_t>> cycles(thread_cnt);
+    std::vector<std::thread>           threads;
+    for (int t = 0; t < thread_cnt; t++) {
+        threads.emplace_back([&, t] {
+            auto &c = cycles[t];
+            c.resize(msg_cnt);
+            logger.preallocate();
+            for (int i = 0; i < msg_cnt; i++) {
+                uint64_t begin = TSCNS::rdtsc();
+                FAST_LOG(INFO, "bench %d %d %s %lf", t, i, "payload", 1.5);
+                c[i] = static_cast<uint32_t>(TSCNS::rdtsc() - begin);
+                if ((i & 1023) == 0) {
+                    // leave the poller some time, measure the queue not the overflow policy
+                    std::this_thread::yield();
+                }
+            }
+        });
+    }
+    for (auto &t : threads) {
+        t.join();
+    }
+    std::vector<uint32_t> all;
+    for (auto &c : cycles) {
+        all.insert(all.end(), c.begin(), c.end());
+    }
+    std::sort(all.begin(), all.end());
+    TSCNS tscns;
+    tscns.init();
+    double ghz = tscns.getTscGhz();
+    auto   pct = [&](double p) { return all[static_cast<size_t>(p * (all.size() - 1))] / ghz; };
+    printf("%-22s p50 %6.1fns p99 %6.1fns p99.9 %7.1fns max %9.1fns\n", name, pct(0.5), pct(0.99), pct(0.999), all.back() / ghz);
+}
+
+static int64_t thread_cpu_ns()
+{
+    timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+static void run_drain(const char *label, int thread_cnt, int active_cnt, int msg_cnt)
+{
+    fast_logger             &logger = fast_logger::get_logger();
+    std::atomic<int>         ready{0};
+    std::atomic<int>         turn{0};
+    std::promise<void>       done;
+    std::shared_future<void> done_future = done.get_future();
+    std::vector<std::thread> threads;
+    for (int t = 0; t < thread_cnt; t++) {
+        threads.emplace_back([&, t] {
+            logger.preallocate();
+            // the active threads take turns, their timestamps interleave
+            // like on a box with a core per thread
+            for (int i = 0; t < active_cnt && i < msg_cnt; i++) {
+                while (turn.load() % active_cnt != t) {
+                    std::this_thread::yield();
+                }
+                FAST_LOG(INFO, "drain %d %d %s %lf", t, i, "payload", 1.5);
+                turn++;
+            }
+            ready++;
+            // keep the buffer registered while the main thread polls
+            done_future.wait();
+        });
+    }
+    while (ready.load() < thread_cnt) {
+        usleep(1000);
+    }
+    TSCNS tscns;
+    tscns.init();
+    size_t  total = static_cast<size_t>(active_cnt) * msg_cnt;
+    size_t  cnt   = 0;
+    int64_t begin = tscns.rdns();
+    // the poller's own share of the polls that wrote something, what stays
+    // serial however many cores there are
+    int64_t cpu_ns = 0;
+    while (cnt < total) {
+        int64_t cpu = thread_cpu_ns();
+        size_t  n   = logger.poll();
+        if (n)
+            cpu_ns += thread_cpu_ns() - cpu;
+        cnt += n;
+    }
+    logger.flush();
+    int64_t drain_ns = tscns.rdns() - begin;
+    int     polls    = 10000;
+    begin            = tscns.rdns();
+    for (int i = 0; i < polls; i++) {
+        logger.poll();
+    }
+    int64_t empty_ns = tscns.rdns() - begin;
+    printf("%-10s %4d threads %d active: %8.0f kmsgs/s, poller cpu %5.1fns/msg, empty poll %7.1fns\n", label, thread_cnt, active_cnt,
+           total * 1e6 / drain_ns, double(cpu_ns) / total, double(empty_ns) / polls);
+    done.set_value();
+    for (auto &t : threads) {
+        t.join();
+    }
+    logger.poll();
+}
+
+static void run_group(int logger_cnt)
+{
+    TSCNS tscns;
+    tscns.init();
+    std::vector<stra_logger *> loggers;
+    for (int i = 0; i < logger_cnt; i++) {
+        loggers.push_back(new stra_logger(tscns));
+        loggers.back()->set_log_sink(new null_sink);
+    }
+    // what a backend_thread does with one task per logger
+    std::vector<std::function<size_t()>> tasks;
+    for (auto log : loggers) {
+        tasks.push_back([log] { return log->poll(); });
+    }
+    stra_logger_group group(tscns);
+    int               rounds = 1000;
+    // STRA_LOG keeps one log id per call site, each logger needs its own
+    std::vector<int>  log_ids(logger_cnt, UNASSIGNED_LOGID);
+    for (int grouped = 0; grouped < 2; grouped++) {
+        auto poll_all = [&] {
+            if (grouped) {
+                group.poll();
+            } else {
+                for (auto &t : tasks) {
+                    t();
+                }
+            }
+        };
+        // every logger, every 10th logger and no logger has a message
+        int64_t ns[3] = {};
+        for (int r = 0; r < rounds; r++) {
+            for (int k = 0; k < 3; k++) {
+                for (int i = 0; k < 2 && i < logger_cnt; i += k ? 10 : 1) {
+                    loggers[i]->log(log_ids[i], __LINE__, INFO, "group %d %d %s %lf", i, r, "payload", 1.5);
+                }
+                int64_t begin = tscns.rdns();
+                poll_all();
+                ns[k] += tscns.rdns() - begin;
+            }
+        }
+        printf("%-10s %4d loggers: round %9.1fns, sparse round %8.1fns, idle round %8.1fns\n", grouped ? "group" : "per logger", logger_cnt,
+               double(ns[0]) / rounds, double(ns[1]) / rounds, double(ns[2]) / rounds);
+        if (!grouped) {
+            for (auto log : loggers) {
+                group.add(log);
+            }
+        }
+    }
+    for (auto log : loggers) {
+        group.remove(log);
+        delete log;
+    }
+}
+
+static void run_spsc(const char *label, int msg_cnt, int publish_batch, bool release_each)
+{
+    SPSCVarQueueOPT  q(1024 * 1024);
+    std::atomic<int> started{0};
+    uint64_t         sum = 0;
+    std::thread      consumer([&] {
+        started++;
+        int cnt = 0;
+        while (cnt < msg_cnt) {
+            auto h = q.front();
+            if (!h) {
+                q.release();
+                continue;
+            }
+            sum += *reinterpret_cast<const uint64_t *>(h + 1);
+            q.pop();
+            if (release_each)
+                q.release();
+            cnt++;
+        }
+        q.release();
+    });
+    while (!started.load()) {
+        std::this_thread::yield();
+    }
+    TSCNS tscns;
+    tscns.init();
+    int64_t begin = tscns.rdns();
+    for (int i = 0; i < msg_cnt; i++) {
+        SPSCVarQueueOPT::MsgHeader *h;
+        while ((h = q.alloc(32)) == nullptr) {
+            q.publish();
+        }
+        h->userdata                      = i;
+        *reinterpret_cast<uint64_t *>(h + 1) = i;
+        q.commit();
+        if ((i + 1) % publish_batch == 0)
+            q.publish();
+    }
+    q.publish();
+    int64_t produce_ns = tscns.rdns() - begin;
+    consumer.join();
+    int64_t total_ns = tscns.rdns() - begin;
+    printf("%-26s producer %5.1fns/msg, %8.0f kmsgs/s (sum %lu)\n", label, double(produce_ns) / msg_cnt, msg_cnt * 1e6 / total_ns, sum);
+}
+
+static void run_startup(int logger_cnt)
+{
+    int64_t                    begin = TSCNS::rdsysns();
+    std::vector<stra_logger *> loggers;
+    for (int i = 0; i < logger_cnt; i++) {
+        loggers.push_back(new stra_logger());
+    }
+    int64_t ctor_ns = TSCNS::rdsysns() - begin;
+    for (auto log : loggers) {
+        delete log;
+    }
+    const char *file = "/tmp/fast_logger_bench.tsc";
+    TSCNS       fresh;
+    begin = TSCNS::rdsysns();
+    fresh.initOnceFromFile(file);
+    int64_t fresh_ns = TSCNS::rdsysns() - begin;
+    TSCNS   saved;
+    begin       = TSCNS::rdsysns();
+    bool reused = saved.initOnceFromFile(file);
+    int64_t saved_ns = TSCNS::rdsysns() - begin;
+    printf("%d stra_loggers: %.1fms, init %.1fms, init from file %.1fms%s\n", logger_cnt, ctor_ns / 1e6, fresh_ns / 1e6, saved_ns / 1e6,
+           reused ? "" : " (file not used)");
+}
+
+int main(int argc, char **argv)
+{
+    bool         drain  = argc > 1 && strcmp(argv[1], "drain") == 0;
+    bool         format = argc > 1 && strcmp(argv[1], "format") == 0;
+    if (argc > 1 && strcmp(argv[1], "spsc") == 0) {
+        int msg_cnt = argc > 2 ? atoi(argv[2]) : 10000000;
+        run_spsc("publish 1, release each", msg_cnt, 1, true);
+        run_spsc("publish 1, release per run", msg_cnt, 1, false);
+        run_spsc("publish 16, release per run", msg_cnt, 16, false);
+        return 0;
+    }
+    if (argc > 1 && strcmp(argv[1], "startup") == 0) {
+        run_startup(argc > 2 ? atoi(argv[2]) : 300);
+        return 0;
+    }
+    if (argc > 1 && strcmp(argv[1], "group") == 0) {
+        run_group(argc > 2 ? atoi(argv[2]) : 500);
+        return 0;
+    }
+    fast_logger &logger = fast_logger::get_logger();
+    if (drain) {
+        int msg_cnt = argc > 2 ? atoi(argv[2]) : 20000;
+        // binary records, measure the merge rather than the formatting
+        logger.set_binary_log_sink(new null_sink);
+        for (drain_order order : {DRAIN_ORDERED, DRAIN_UNORDERED}) {
+            logger.set_drain_order(order);
+            for (int thread_cnt : {4, 16, 64, 256}) {
+                run_drain(order == DRAIN_ORDERED ? "ordered" : "unordered", thread_cnt, 4, msg_cnt);
+            }
+        }
+        return 0;
+    }
+    if (format) {
+        int msg_cnt = argc > 2 ? atoi(argv[2]) : 50000;
+        logger.set_log_sink(new null_sink);
+        for (uint32_t workers : {0, 1, 2, 4}) {
+            char label[32];
+            snprintf(label, sizeof(label), "%u workers", workers);
+            logger.set_format_workers(workers);
+            run_drain(label, 4, 4, msg_cnt);
+        }
+        return 0;
+    }
+
+    int thread_cnt = argc > 2 ? atoi(argv[2]) : 4;
+    int msg_cnt    = argc > 3 ? atoi(argv[3]) : 200000;
+    logger.set_log_file("/dev/null");
+    logger.start_backend();
+
+    staging_buffer_options opts;
+    run_latency("4k pages", opts, thread_cnt, msg_cnt);
+    opts.compact_records = true;
+    run_latency("4k pages, compact", opts, thread_cnt, msg_cnt);
+    opts.compact_records = false;
+    opts.huge_pages = true;
+    run_latency("huge pages", opts, thread_cnt, msg_cnt);
+    opts.numa_local = true;
+    run_latency("huge pages, numa local", opts, thread_cnt, msg_cnt);
+
+    logger.stop_backend();
+    return 0;
+}
@@ -1,7 +1,14 @@
+#include "backend_thread.h"
 #include "fast_logger.h"
+#include "mmap_file_appender.h"
 #include "stra_logger.h"
+#include "stra_logger_group.h"
 #include "tscns.h"
+#include <limits>
+#include <string>
 #include <sys/time.h>
+#include <thread>
+#include <vector>
 
 inline static uint64_t get_current_nano_sec()
 {
@@ -10,6 +17,444 @@ inline static uint64_t get_current_nano_sec()
     return ts.tv_sec * 1000000000 + ts.tv_nsec;
 }
 
+// keeps the text lines in memory
+class capture_sink : public log_sink
+{
+  public:
+    void append(const char *data, const size_t len) override
+    {
+        text.append(data, len);
+    }
+    void flush() override
+    {
+    }
+
+    std::string text;
+};
+
+static std::string read_file(const char *path)
+{
+    std::string text;
+    FILE       *fp = fopen(path, "rb");
+    if (!fp)
+        return text;
+    char   buf[64 * 1024];
+    size_t n;
+    while ((n = fread(buf, 1, sizeof(buf), fp)) > 0) {
+        text.append(buf, n);
+    }
+    fclose(fp);
+    return text;
+}
+
+// prints what did not hold, returns the number of failures to add up
+static int expect(bool ok, const char *label, const char *what)
+{
+    if (!ok)
+        std::cout << label << " check failed: " << what << std::endl;
+    return ok ? 0 : 1;
+}
+
+// compares the messages of a sink with the snprintf output
+static int compare_lines(const char *label, const std::string &text, const std::vector<std::string> &expected)
+{
+    int         failures = 0;
+    size_t      line     = 0;
+    const char *tag      = "] [INFO] ";
+    for (size_t pos = 0; pos < text.size(); line++) {
+        size_t      end = text.find('\n', pos);
+        size_t      msg = text.find(tag, pos) + strlen(tag);
+        std::string got = text.substr(msg, end - msg);
+        if (line >= expected.size() || got != expected[line]) {
+            std::cout << label << " format mismatch: got \"" << got << "\" expected \"" << (line < expected.size() ? expected[line] : "") << "\""
+                      << std::endl;
+            failures++;
+        }
+        pos = end + 1;
+    }
+    if (line != expected.size()) {
+        std::cout << label << " format check: " << line << " lines for " << expected.size() << " formats" << std::endl;
+        failures++;
+    }
+    return failures;
+}
+
+// logs each format through the hand written formatters, with either record
+// encoding, and compares the messages with snprintf's
+#define CHECK_FORMAT(format, ...)                                                                                                                    \
+    do {                                                                                                                                             \
+        STRA_LOG(fmt_log, INFO, format, ##__VA_ARGS__);                                                                                              \
+        STRA_LOG(compact_log, INFO, format, ##__VA_ARGS__);                                                                                          \
+        snprintf(buf, sizeof(buf), format, ##__VA_ARGS__);                                                                                           \
+        expected.push_back(buf);                                                                                                                     \
+    } while (0)
+
+static int check_formatting(TSCNS &tscns)
+{
+    stra_logger             *fmt_log      = new stra_logger(tscns);
+    stra_logger             *compact_log  = new stra_logger(tscns);
+    capture_sink            *sink         = new capture_sink;
+    capture_sink            *compact_sink = new capture_sink;
+    std::vector<std::string> expected;
+    char                     buf[512];
+    const double             inf = std::numeric_limits<double>::infinity();
+    const double             nan = std::numeric_limits<double>::quiet_NaN();
+    staging_buffer_options   opts;
+    opts.compact_records = true;
+    compact_log->set_staging_buffer_options(opts);
+    fmt_log->set_log_sink(sink);
+    compact_log->set_log_sink(compact_sink);
+
+    CHECK_FORMAT("%d|%i|%u", 0, -1, 4294967295u);
+    CHECK_FORMAT("%lld|%lld", (long long)INT64_MIN, (long long)INT64_MAX);
+    CHECK_FORMAT("%ld|%llu|%zu", (long)INT64_MIN, (unsigned long long)UINT64_MAX, (size_t)12345);
+    CHECK_FORMAT("%-*d|%*d|%-*d|", 6, 42, 6, -42, -6, 7);
+    CHECK_FORMAT("%+05d|%+05d|% d|% 5d|%+d", 42, -42, 42, -42, 0);
+    CHECK_FORMAT("%05d|%-5d|%5.3d|%.0d|%.0d|", -7, -7, 7, 0, 3);
+    CHECK_FORMAT("%x|%X|%#x|%#X|%o|%#o|%#o", 255, 255, 255, 0, 8, 8, 0);
+    CHECK_FORMAT("%#010x|%-#10x|%.5x", 255, 255, 255);
+    CHECK_FORMAT("%hd|%hu|%hhd|%hhu", (short)-32768, (unsigned short)65535, (signed char)-128, (unsigned char)255);
+    CHECK_FORMAT("%c|%3c|%-3c|%d", 'a', 'b', 'c', true);
+    CHECK_FORMAT("%f|%.2f", 1.5f, -0.1f);
+    CHECK_FORMAT("%f|%f|%f|%f", 0.0, -0.0, 1.5, -1.020215);
+    CHECK_FORMAT("%.0f|%.0f|%.0f|%.0f|%.0f", 0.5, 1.5, 2.5, -0.5, 3.5);
+    CHECK_FORMAT("%.1f|%.2f|%.2f|%.2f|%.3f", 0.25, 0.125, 0.375, 1.005, 2.0005);
+    CHECK_FORMAT("%#.0f|%+.2f|% .2f|%010.3f|%-10.3f|", 1.0, 3.14159, 3.14159, -3.14159, 3.14159);
+    CHECK_FORMAT("%f|%.3f|%.10f|%.17f", 1e15, 123456789.987654321, 1e-7, 0.1);
+    CHECK_FORMAT("%f|%.1f|%f", 1e300, 9.96, 0.9999995);
+    CHECK_FORMAT("%f|%F|%f|%5.1f|%-6f|%+f", inf, inf, -inf, inf, inf, inf);
+    CHECK_FORMAT("%f|%F|%5f|%-5f|", nan, nan, nan, nan);
+    CHECK_FORMAT("%e|%.3g|%a", 12345.678, 0.0001234, 1.0);
+    CHECK_FORMAT("%s|%10s|%-10s|%.3s|%-6.2s|", "abc", "abc", "abc", "abcdef", "abcdef");
+    CHECK_FORMAT("%*.*e|%-12.4g|%+.2a|%Lg", 14, 3, -12345.678, 1e-5, 3.0, 1.5L);
+
+    fmt_log->poll();
+    compact_log->poll();
+    int failures = compare_lines("standard", sink->text, expected) + compare_lines("compact", compact_sink->text, expected);
+    delete fmt_log;
+    delete compact_log;
+    return failures;
+}
+
+// writes through every batch_file_appender mode with buffers small enough
+// to be recycled. The flushes in between pad the O_DIRECT tail and cut the
+// file back, the second round reopens the file and starts from its partial
+// last block.
+static int check_batch_appender()
+{
+    const char *path     = "../test_batch.log";
+    int         failures = 0;
+    for (int mode = BATCH_IO_WRITEV; mode <= BATCH_IO_URING; mode++) {
+        for (int direct = 0; direct < 2; direct++) {
+            char label[32];
+            snprintf(label, sizeof(label), "batch %s%s", mode == BATCH_IO_URING ? "io_uring" : "pwritev", direct ? " O_DIRECT" : "");
+            ::unlink(path);
+            batch_file_options opts;
+            opts.mode         = static_cast<batch_io_mode>(mode);
+            opts.direct       = direct;
+            opts.buffer_bytes = 4096;
+            opts.buffer_cnt   = 2;
+            std::string expected;
+            for (int round = 0; round < 2; round++) {
+                batch_file_appender *sink = new batch_file_appender(path, opts);
+                for (int i = 0; i < 1000; i++) {
+                    char line[64];
+                    int  len = snprintf(line, sizeof(line), "%s round %d line %d\n", label, round, i);
+                    sink->append(line, len);
+                    expected.append(line, len);
+                    if (i % 300 == 299) {
+                        sink->flush();
+                        failures += expect(read_file(path) == expected, label, "file content after flush");
+                    }
+                }
+                delete sink;
+                failures += expect(read_file(path) == expected, label, "file content after close");
+            }
+        }
+    }
+    ::unlink(path);
+    return failures;
+}
+
+// appends across several one page windows, closes and reopens the file at
+// an unaligned size, the file has to end with the last line and no zeros
+static int check_mmap_appender()
+{
+    const char *label    = "mmap";
+    const char *path     = "../test_mmap.log";
+    int         failures = 0;
+    std::string expected;
+    ::unlink(path);
+    for (int round = 0; round < 2; round++) {
+        mmap_file_appender *sink = new mmap_file_appender(path, 4096);
+        for (int i = 0; i < 500; i++) {
+            char line[64];
+            int  len = snprintf(line, sizeof(line), "mmap round %d line %d\n", round, i);
+            sink->append(line, len);
+            expected.append(line, len);
+        }
+        sink->flush();
+        delete sink;
+        std::string text = read_file(path);
+        failures += expect(text.find('\0') == std::string::npos, label, "zero padding left in the file");
+        failures += expect(text == expected, label, "file content after close");
+    }
+    ::unlink(path);
+    return failures;
+}
+
+// producers log through the global logger with DRAIN_UNORDERED into their
+// own files, each file has to hold exactly its thread's lines in order.
+// Runs before anything else polls the global logger.
+static int check_unordered_drain()
+{
+    const char  *label   = "unordered drain";
+    const char  *prefix  = "../test_thread";
+    const int    threads = 3;
+    const int    lines   = 5000;
+    fast_logger &logger  = fast_logger::get_logger();
+    logger.set_drain_order(DRAIN_UNORDERED);
+    logger.set_per_thread_log_files(prefix);
+    std::vector<std::string> files(threads);
+    std::atomic<int>         done{0};
+    std::vector<std::thread> producers;
+    for (int t = 0; t < threads; t++) {
+        producers.emplace_back([&, t] {
+            files[t] = std::string(prefix) + "." + std::to_string(syscall(SYS_gettid)) + ".log";
+            ::unlink(files[t].c_str());
+            for (int i = 0; i < lines; i++) {
+                FAST_LOG(INFO, "thread %d line %d", t, i);
+            }
+            done.fetch_add(1);
+        });
+    }
+    while (done.load() < threads) {
+        logger.poll();
+    }
+    for (auto &p : producers) {
+        p.join();
+    }
+    // the buffers of the exited threads are released once drained, which
+    // closes their files
+    while (logger.poll()) {
+    }
+    logger.set_per_thread_log_files("");
+    logger.set_drain_order(DRAIN_ORDERED);
+
+    int failures = 0;
+    for (int t = 0; t < threads; t++) {
+        std::string text  = read_file(files[t].c_str());
+        const char *tag   = "] [INFO] ";
+        int         count = 0;
+        for (size_t pos = 0; pos < text.size();) {
+            size_t end = text.find('\n', pos);
+            size_t msg = text.find(tag, pos);
+            int    thread, i;
+            if (end == std::string::npos || msg > end || sscanf(text.c_str() + msg + strlen(tag), "thread %d line %d", &thread, &i) != 2) {
+                failures += expect(false, label, "corrupt line");
+                break;
+            }
+            failures += expect(thread == t && i == count, label, "line of another thread or out of order");
+            count++;
+            pos = end + 1;
+        }
+        failures += expect(count == lines, label, "lines missing from a thread's file");
+        ::unlink(files[t].c_str());
+    }
+    return failures;
+}
+
+// the messages of the lines a capture_sink got, without the prefix
+static std::vector<std::string> split_messages(const std::string &text)
+{
+    std::vector<std::string> msgs;
+    const char              *tag = "] [INFO] ";
+    for (size_t pos = 0; pos < text.size();) {
+        size_t end = text.find('\n', pos);
+        size_t msg = text.find(tag, pos);
+        if (end == std::string::npos || msg > end)
+            break;
+        msg += strlen(tag);
+        msgs.push_back(text.substr(msg, end - msg));
+        pos = end + 1;
+    }
+    return msgs;
+}
+
+// logs n lines through a fresh logger with opts and returns what reached its
+// sink. With concurrent another thread logs while this one polls, otherwise
+// every line is logged before the first poll.
+static std::vector<std::string> log_lines(TSCNS &tscns, const staging_buffer_options &opts, int n, bool concurrent, staging_buffer_stats &stats)
+{
+    stra_logger  *log  = new stra_logger(tscns);
+    capture_sink *sink = new capture_sink;
+    log->set_log_sink(sink);
+    log->set_staging_buffer_options(opts);
+    int  log_id  = UNASSIGNED_LOGID;
+    auto produce = [&] {
+        for (int i = 0; i < n; i++) {
+            log->log(log_id, __LINE__, INFO, "line %d %s", i, "..................................................");
+        }
+    };
+    if (concurrent) {
+        std::atomic<bool> done{false};
+        std::thread       producer([&] {
+            produce();
+            done.store(true);
+        });
+        while (!done.load()) {
+            log->poll();
+        }
+        producer.join();
+    } else {
+        produce();
+    }
+    log->poll();
+    log->get_stats(stats);
+    std::vector<std::string> msgs = split_messages(sink->text);
+    delete log;
+    return msgs;
+}
+
+// the line numbers have to increase, gaps are lines counted as dropped
+static int check_line_numbers(const char *label, const std::vector<std::string> &msgs, bool gaps)
+{
+    int failures = 0;
+    int prev     = -1;
+    for (auto &msg : msgs) {
+        int i = -1;
+        sscanf(msg.c_str(), "line %d", &i);
+        failures += expect(gaps ? i > prev : i == prev + 1, label, "lines out of order or lost");
+        prev = i;
+    }
+    return failures;
+}
+
+// the overflow and large message policies, the lines that reach the sink
+// and the dropped counter have to add up to the lines logged
+static int check_overflow_policies(TSCNS &tscns)
+{
+    const int            n        = 10000;
+    int                  failures = 0;
+    staging_buffer_stats stats;
+
+    staging_buffer_options opts;
+    opts.queue_bytes              = 64 * 1024;
+    opts.policy                   = OVERFLOW_DROP;
+    std::vector<std::string> msgs = log_lines(tscns, opts, n, false, stats);
+    failures += expect(stats.dropped > 0 && msgs.size() + stats.dropped == n, "overflow drop", "lines plus dropped do not add up");
+    failures += expect(stats.msgs == msgs.size(), "overflow drop", "msgs counter");
+    failures += check_line_numbers("overflow drop", msgs, true);
+
+    opts.policy = OVERFLOW_BLOCK;
+    msgs        = log_lines(tscns, opts, n, true, stats);
+    failures += expect(stats.dropped == 0 && msgs.size() == n && stats.msgs == n, "overflow block", "lines lost or counted as dropped");
+    failures += check_line_numbers("overflow block", msgs, false);
+
+    opts.policy      = OVERFLOW_SPILL;
+    opts.spill_bytes = 64 * 1024;
+    msgs             = log_lines(tscns, opts, n, false, stats);
+    failures += expect(msgs.size() + stats.dropped == n, "overflow spill", "lines plus dropped do not add up");
+    failures += expect(stats.msgs == msgs.size(), "overflow spill", "msgs counter");
+    failures += check_line_numbers("overflow spill", msgs, true);
+
+    // a 300 KiB string argument, above the default large_msg_bytes
+    std::string snapshot(300 * 1024, 'x');
+    for (int policy = LARGE_MSG_OUT_OF_LINE; policy <= LARGE_MSG_DROP; policy++) {
+        const char *label = policy == LARGE_MSG_OUT_OF_LINE ? "large out of line" : policy == LARGE_MSG_TRUNCATE ? "large truncate" : "large drop";
+        stra_logger  *log  = new stra_logger(tscns);
+        capture_sink *sink = new capture_sink;
+        log->set_log_sink(sink);
+        staging_buffer_options large_opts;
+        large_opts.large_policy = static_cast<large_msg_policy>(policy);
+        log->set_staging_buffer_options(large_opts);
+        int log_id = UNASSIGNED_LOGID;
+        log->log(log_id, __LINE__, INFO, "snapshot %s %d", snapshot.c_str(), 7);
+        log->poll();
+        log->get_stats(stats);
+        msgs = split_messages(sink->text);
+        delete log;
+        if (policy == LARGE_MSG_OUT_OF_LINE) {
+            failures += expect(msgs.size() == 1 && msgs[0] == "snapshot " + snapshot + " 7", label, "message content");
+        } else if (policy == LARGE_MSG_TRUNCATE) {
+            bool cut = msgs.size() == 1 && msgs[0].size() < large_opts.large_msg_bytes && msgs[0].compare(0, 10, "snapshot x") == 0 &&
+                       msgs[0].compare(msgs[0].size() - 2, 2, " 7") == 0;
+            failures += expect(cut, label, "message not cut to large_msg_bytes");
+        } else {
+            failures += expect(msgs.empty() && stats.dropped == 1, label, "message not dropped and counted");
+        }
+    }
+    return failures;
+}
+
+// the current file and the rotated ones, <base> and <base>.*
+static std::vector<std::string> list_log_files(const char *base)
+{
+    std::vector<std::string> files;
+    DIR                     *d = ::opendir("..");
+    if (!d)
+        return files;
+    size_t len = strlen(base);
+    while (dirent *e = ::readdir(d)) {
+        if (strncmp(e->d_name, base, len) == 0 && (e->d_name[len] == '\0' || e->d_name[len] == '.'))
+            files.push_back(std::string("../") + e->d_name);
+    }
+    ::closedir(d);
+    return files;
+}
+
+// rotates by size every few lines and checks that across the current and
+// the rotated files every line is there once, each file holds a contiguous
+// run of lines and stays below max_bytes
+static int check_rotation()
+{
+    const char *label = "rotation";
+    const char *base  = "test_rotate.log";
+    for (auto &f : list_log_files(base)) {
+        ::unlink(f.c_str());
+    }
+    rotation_options opts;
+    opts.max_bytes = 1024;
+    const int lines = 200;
+    {
+        file_appender sink("../test_rotate.log", opts);
+        for (int i = 0; i < lines; i++) {
+            char line[64];
+            int  len = snprintf(line, sizeof(line), "rotated line %06d ..............................\n", i);
+            sink.append(line, len);
+            // give the helper thread time to open the next file
+            usleep(1000);
+        }
+    }
+    int                      failures = 0;
+    std::vector<std::string> files    = list_log_files(base);
+    std::vector<int>         seen(lines, 0);
+    for (auto &f : files) {
+        failures += expect(f.find(".next") == std::string::npos, label, "leftover .next file");
+        std::string text = read_file(f.c_str());
+        failures += expect(text.size() <= opts.max_bytes, label, "file larger than max_bytes");
+        int prev = -1;
+        for (size_t pos = 0; pos < text.size();) {
+            size_t end = text.find('\n', pos);
+            int    i   = -1;
+            if (end == std::string::npos || sscanf(text.c_str() + pos, "rotated line %d", &i) != 1 || i < 0 || i >= lines) {
+                failures += expect(false, label, "corrupt line");
+                break;
+            }
+            failures += expect(prev < 0 || i == prev + 1, label, "lines out of order within a file");
+            seen[i]++;
+            prev = i;
+            pos  = end + 1;
+        }
+        ::unlink(f.c_str());
+    }
+    failures += expect(files.size() > 1, label, "no file was rotated");
+    for (int i = 0; i < lines; i++) {
+        failures += expect(seen[i] == 1, label, "line lost or duplicated");
+    }
+    return failures;
+}
+
 int main()
 {
     TSCNS tscns;
@@ -29,13 +474,43 @@ int main()
 
     stra_logger *log_2 = new stra_logger(tscns);
     log_2->set_log_level(INFO);
+    log_2->set_time_format(TIME_NS, true);
     log_2->set_log_file("../test2.log");
     STRA_LOG(log_2, DEBUG, "%d %d %s %lf", 10, 111, "test", 1.020215);
     log_2->poll();
     STRA_LOG(log_2, DEBUG, "%d %d %s %.1lf", 10, 111, "test2", 1.020215);
-    log_2->poll();
+    STRA_LOG(log_2, INFO, "%s", "utc, ns precision");
+    log_2->flush();
+
+    stra_logger *log_3 = new stra_logger(tscns);
+    log_3->set_binary_log_file("../test3.bin");
+    STRA_LOG(log_3, INFO, "%d %s %.3lf", 10, "binary", 1.020215);
+    log_3->poll();
+    delete log_3;
+
+    stra_logger           *log_7 = new stra_logger(tscns);
+    staging_buffer_options compact_opts;
+    compact_opts.compact_records = true;
+    log_7->set_staging_buffer_options(compact_opts);
+    log_7->set_log_file("../test7.log");
+    STRA_LOG(log_7, INFO, "%d %ld %u %s %.3lf", -10, 1L << 40, 4000000000u, "compact", 1.020215);
+    STRA_LOG(log_7, INFO, "%*d|%s|", -6, 42, "");
+    log_7->poll();
+    delete log_7;
+
+    stra_logger       *log_4 = new stra_logger(tscns);
+    batch_file_options batch_opts;
+    batch_opts.mode = BATCH_IO_URING;
+    log_4->set_log_sink(new batch_file_appender("../test4.log", batch_opts));
+    STRA_LOG(log_4, INFO, "%d %s", 10, "batched");
+    log_4->poll();
+    delete log_4;
+
+    int failures = check_unordered_drain();
 
+    fast_logger::install_crash_handler();
     FAST_LOG(DEBUG, "%d %d", 5, 5);
+    FAST_LOG_STATIC(INFO, "%s %d", "registered before main", 6);
     fast_logger::get_logger().poll();
 
     auto t0 = get_current_nano_sec();
@@ -56,7 +531,53 @@ int main()
     t1 = get_current_nano_sec();
     std::cout << (t1 - t0) / 4500.0 << std::endl;
     log_1->poll();
+
+    // larger than large_msg_bytes, goes out of line
+    std::string snapshot(300 * 1024, 'x');
+    STRA_LOG(log_1, INFO, "snapshot %s %d", snapshot.c_str(), 7);
+    log_1->poll();
+
+    stra_logger *log_5 = new stra_logger(tscns);
+    stra_logger *log_6 = new stra_logger(tscns);
+    log_5->set_log_file("../test5.log");
+    log_6->set_log_file("../test6.log");
+    stra_logger_group group(tscns);
+    group.add(log_5);
+    group.add(log_6);
+    STRA_LOG(log_5, INFO, "%s %d", "grouped", 5);
+    STRA_LOG(log_6, INFO, "%s %d", "grouped", 6);
+    group.poll();
+    group.remove(log_5);
+    delete log_5;
+
+    // recalibrate on every poll and log the drift
+    tscns.setCalibrateInterval(1000000);
+    log_6->set_log_calibrations(true);
+    usleep(2000);
+    group.poll();
+    tscns_stats tsc_stats = log_6->get_tsc_stats();
+    std::cout << "tsc calibrations " << tsc_stats.calibrations << " err " << tsc_stats.last_err_ns << "ns" << std::endl;
+
+    backend_thread backend;
+    backend_options opts;
+    opts.idle = IDLE_SLEEP;
+    uint32_t task_id = backend.add_logger(log);
+    uint32_t group_task_id = backend.add_logger(&group);
+    backend.start(opts);
+    STRA_LOG(log, INFO, "%s %d", "polled by backend", 1);
+    STRA_LOG(log_6, INFO, "%s %d", "group polled by backend", 6);
+    backend.stop();
+    backend.remove_task(task_id);
+    backend.remove_task(group_task_id);
+    group.remove(log_6);
+    delete log_6;
     delete log;
     delete log_1;
 
+    failures += check_formatting(tscns);
+    failures += check_batch_appender();
+    failures += check_rotation();
+    failures += check_mmap_appender();
+    failures += check_overflow_policies(tscns);
+    return failures ? 1 : 0;
 }
\ No newline at end of file
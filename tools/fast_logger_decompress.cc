@@ -0,0 +1,232 @@
+// Turns a binary log written via set_binary_log_file() back into the text
+// format log_handler produces in text mode.
+//
+//   fast_logger_decompress <binary log> [text output]
+#include "binary_log.h"
+#include "log_handler.h"
+#include "static_log_info.h"
+#include "tscns.h"
+#include <deque>
+#include <fcntl.h>
+#include <memory>
+#include <stdio.h>
+#include <string.h>
+#include <string>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <vector>
+
+class decompressor
+{
+  public:
+    decompressor(const char *data, size_t len, const char *output) : begin_(data), data_(data), end_(data + len), output_(output)
+    {
+    }
+
+    bool run()
+    {
+        while (data_ < end_) {
+            if (is_session_start()) {
+                if (!start_session())
+                    return false;
+                continue;
+            }
+            if (!handler_) {
+                fprintf(stderr, "missing file header at offset %zu\n", offset());
+                return false;
+            }
+            uint8_t type = *data_++;
+            bool    ok   = false;
+            switch (type) {
+                case 0:
+                    // zeros mmap_file_appender left behind after a crash
+                    ok = true;
+                    break;
+                case binary_log::ENTRY_LOG_INFO:
+                    ok = read_log_info();
+                    break;
+                case binary_log::ENTRY_TSC_PARAM:
+                    ok = read_tsc_param();
+                    break;
+                case binary_log::ENTRY_THREAD_NAME:
+                    ok = read_thread_name();
+                    break;
+                case binary_log::ENTRY_LOG:
+                    ok = read_log();
+                    break;
+                case binary_log::ENTRY_TEXT:
+                    ok = read_text();
+                    break;
+                default:
+                    break;
+            }
+            if (!ok) {
+                fprintf(stderr, "corrupt or truncated entry (type %u) at offset %zu\n", type, offset());
+                return false;
+            }
+        }
+        return true;
+    }
+
+  private:
+    size_t offset() const
+    {
+        return static_cast<size_t>(data_ - begin_);
+    }
+
+    bool is_session_start() const
+    {
+        return static_cast<size_t>(end_ - data_) >= sizeof(binary_log::file_header) &&
+               memcmp(data_, binary_log::MAGIC, sizeof(binary_log::MAGIC)) == 0;
+    }
+
+    bool start_session()
+    {
+        binary_log::file_header fh;
+        memcpy(&fh, data_, sizeof(fh));
+        data_ += sizeof(fh);
+        if (fh.version != binary_log::VERSION) {
+            fprintf(stderr, "unsupported binary log version %u at offset %zu\n", fh.version, offset() - sizeof(fh));
+            return false;
+        }
+        handler_.reset();
+        tscns_.reset(new TSCNS());
+        tscns_->setParams(0, 0, 1.0);
+        handler_.reset(new log_handler(*tscns_));
+        if (output_) {
+            handler_->set_log_file(output_);
+        }
+        thread_name_[0] = '\0';
+        return true;
+    }
+
+    template <typename T>
+    bool read_struct(T &out)
+    {
+        if (static_cast<size_t>(end_ - data_) < sizeof(T))
+            return false;
+        memcpy(&out, data_, sizeof(T));
+        data_ += sizeof(T);
+        return true;
+    }
+
+    bool read_log_info()
+    {
+        binary_log::log_info_entry entry;
+        if (!read_struct(entry) || static_cast<size_t>(end_ - data_) < entry.fmt_len + entry.args_num)
+            return false;
+        if (entry.log_id != handler_->get_log_infos_cnt()) {
+            fprintf(stderr, "unexpected log id %u, expect %zu\n", entry.log_id, handler_->get_log_infos_cnt());
+            return false;
+        }
+        fmt_strs_.emplace_back(data_, entry.fmt_len);
+        data_ += entry.fmt_len;
+        arg_sizes_.emplace_back(data_, entry.args_num);
+        data_ += entry.args_num;
+        static_log_info info(entry.line_num, static_cast<log_level>(entry.level), fmt_strs_.back().c_str(), entry.args_num,
+                             reinterpret_cast<const uint8_t *>(arg_sizes_.back().data()));
+        char           *p = static_cast<char *>(malloc(info.fragments_size()));
+        info.create_log_fragments(&p);
+        handler_->add_log_info(info);
+        return true;
+    }
+
+    bool read_tsc_param()
+    {
+        binary_log::tsc_param_entry entry;
+        if (!read_struct(entry))
+            return false;
+        tscns_->setParams(entry.base_tsc, entry.base_ns, entry.ns_per_tsc);
+        return true;
+    }
+
+    bool read_thread_name()
+    {
+        binary_log::thread_name_entry entry;
+        if (!read_struct(entry) || entry.len >= sizeof(thread_name_) || static_cast<size_t>(end_ - data_) < entry.len)
+            return false;
+        memcpy(thread_name_, data_, entry.len);
+        thread_name_[entry.len] = '\0';
+        data_ += entry.len;
+        return true;
+    }
+
+    bool read_log()
+    {
+        staging_buffer::queue_header header;
+        if (static_cast<size_t>(end_ - data_) < sizeof(header))
+            return false;
+        memcpy(&header, data_, sizeof(header));
+        if (header.size < sizeof(header) + sizeof(uint64_t) || static_cast<size_t>(end_ - data_) < header.size)
+            return false;
+        if (staging_buffer::log_id(&header) >= handler_->get_log_infos_cnt()) {
+            fprintf(stderr, "unknown log id %u\n", staging_buffer::log_id(&header));
+            return false;
+        }
+        // records are not aligned in the file, handle_log expects an aligned header
+        record_.resize((header.size + sizeof(header) - 1) / sizeof(header));
+        memcpy(record_.data(), data_, header.size);
+        data_ += header.size;
+        handler_->handle_log(thread_name_, record_.data());
+        return true;
+    }
+
+    bool read_text()
+    {
+        binary_log::text_entry entry;
+        if (!read_struct(entry) || entry.level >= NUM_LOG_LEVELS || static_cast<size_t>(end_ - data_) < entry.len)
+            return false;
+        handler_->write_text_log(thread_name_, static_cast<log_level>(entry.level), entry.ns, data_, entry.len);
+        data_ += entry.len;
+        return true;
+    }
+
+  private:
+    const char                               *begin_;
+    const char                               *data_;
+    const char                               *end_;
+    const char                               *output_;
+    std::unique_ptr<TSCNS>                    tscns_;
+    std::unique_ptr<log_handler>              handler_;
+    std::deque<std::string>                   fmt_strs_;
+    std::deque<std::string>                   arg_sizes_;
+    std::vector<staging_buffer::queue_header> record_;
+    char                                      thread_name_[16] = {0};
+};
+
+int main(int argc, char **argv)
+{
+    if (argc < 2) {
+        fprintf(stderr, "usage: %s <binary log> [text output]\n", argv[0]);
+        return 1;
+    }
+    int fd = ::open(argv[1], O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        perror(argv[1]);
+        return 1;
+    }
+    struct stat st;
+    if (::fstat(fd, &st) != 0) {
+        perror("fstat");
+        ::close(fd);
+        return 1;
+    }
+    if (st.st_size == 0) {
+        ::close(fd);
+        return 0;
+    }
+    void *data = ::mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    ::close(fd);
+    if (data == MAP_FAILED) {
+        perror("mmap");
+        return 1;
+    }
+    bool ok;
+    {
+        decompressor d(static_cast<const char *>(data), st.st_size, argc > 2 ? argv[2] : nullptr);
+        ok = d.run();
+    }
+    ::munmap(data, st.st_size);
+    return ok ? 0 : 1;
+}